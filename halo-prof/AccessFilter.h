@@ -0,0 +1,233 @@
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+struct AddressRange {
+    ADDRINT start;
+    ADDRINT end;
+};
+
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+// Whether a routine matched any include or exclude filter
+#define FILTER_INCLUDED 1
+#define FILTER_EXCLUDED 2
+
+// Decides which code has its heap accesses instrumented. Code is profiled if
+// it matches any include filter (or there are none) and no exclude filter.
+// Accesses made by the rest are either left uninstrumented, or traced only as
+// filler that ages the affinity window without taking part in affinity.
+namespace AccessFilter {
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+
+KNOB<string> KnobIncludeImages(KNOB_MODE_WRITEONCE, "pintool",
+    "include-images", "", "comma-separated list of image file name globs "
+    "(e.g. 'myapp,libfoo*.so') to profile heap accesses made from");
+KNOB<string> KnobExcludeImages(KNOB_MODE_WRITEONCE, "pintool",
+    "exclude-images", "", "comma-separated list of image file name globs "
+    "(e.g. 'libc.so*,libstdc++*') not to profile heap accesses made from");
+KNOB<string> KnobIncludeFunctions(KNOB_MODE_WRITEONCE, "pintool",
+    "include-functions", "", "comma-separated list of function name globs "
+    "to profile heap accesses made from");
+KNOB<string> KnobExcludeFunctions(KNOB_MODE_WRITEONCE, "pintool",
+    "exclude-functions", "", "comma-separated list of function name globs "
+    "not to profile heap accesses made from");
+KNOB<string> KnobIncludeRanges(KNOB_MODE_WRITEONCE, "pintool",
+    "include-ranges", "", "comma-separated list of start-end code address "
+    "ranges in the main executable (before relocation, as call sites are "
+    "printed in the contexts file) to profile heap accesses made from");
+KNOB<string> KnobExcludeRanges(KNOB_MODE_WRITEONCE, "pintool",
+    "exclude-ranges", "", "comma-separated list of start-end code address "
+    "ranges in the main executable (before relocation) not to profile heap "
+    "accesses made from");
+KNOB<string> KnobFilteredAccesses(KNOB_MODE_WRITEONCE, "pintool",
+    "filtered-accesses", "ignore", "what to do with heap accesses from code "
+    "that isn't profiled: 'ignore' them, or count them as affinity distance "
+    "'filler'");
+
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static bool enabled = false;
+static bool filler = false;
+static bool has_includes = false;
+
+static vector<string> include_images, exclude_images;
+static vector<string> include_functions, exclude_functions;
+static vector<AddressRange> include_ranges, exclude_ranges;
+
+// The image and function filters matched by each routine (by address).
+// Instrumentation is serialised by Pin, so this needs no locking.
+static unordered_map<ADDRINT, UINT32> routine_filters;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+// Match 'str' against a pattern in which '*' matches any run of characters
+// and '?' matches any one character
+static bool glob_match(const char *pattern, const char *str) {
+    for (; *pattern != '*'; ++pattern, ++str) {
+        if (!*pattern)
+            return !*str;
+        if (!*str || (*pattern != '?' && *pattern != *str))
+            return false;
+    }
+
+    // Try every possible length for the run matched by '*'
+    do {
+        if (glob_match(pattern + 1, str))
+            return true;
+    } while (*str++);
+    return false;
+}
+
+static bool matches_any(const vector<string> &patterns, const string &str) {
+    for (size_t i = 0; i < patterns.size(); ++i)
+        if (glob_match(patterns[i].c_str(), str.c_str()))
+            return true;
+    return false;
+}
+
+static bool in_any(const vector<AddressRange> &ranges, ADDRINT addr) {
+    for (size_t i = 0; i < ranges.size(); ++i)
+        if (addr >= ranges[i].start && addr < ranges[i].end)
+            return true;
+    return false;
+}
+
+static vector<string> parse_globs(const string &list) {
+    vector<string> result;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos)
+            end = list.size();
+        if (end > start)
+            result.push_back(list.substr(start, end - start));
+        start = end + 1;
+    }
+    return result;
+}
+
+static vector<AddressRange> parse_ranges(const string &list) {
+    vector<AddressRange> result;
+    const char *str = list.c_str();
+    while (*str) {
+        char *end;
+        AddressRange range;
+        range.start = strtoull(str, &end, 0);
+        bool valid = end != str && *end == '-';
+        if (valid) {
+            str = end + 1;
+            range.end = strtoull(str, &end, 0);
+            valid = end != str && range.end > range.start;
+        }
+        if (!valid || (*end && *end != ',')) {
+            cerr << "ERROR: address ranges must be given as 'start-end'\n";
+            PIN_ExitApplication(1);
+        }
+        result.push_back(range);
+        str = *end ? end + 1 : end;
+    }
+    return result;
+}
+
+// Return the file name of an image, without its directory
+static string image_name(IMG img) {
+    if (!IMG_Valid(img))
+        return "";
+    const string &path = IMG_Name(img);
+    size_t slash = path.rfind('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+// Match a routine's image and (mangled or demangled) name against the filters
+static UINT32 match_routine(RTN rtn, ADDRINT addr) {
+    string image, name, demangled;
+    if (RTN_Valid(rtn)) {
+        image = image_name(SEC_Img(RTN_Sec(rtn)));
+        name = RTN_Name(rtn);
+        demangled = PIN_UndecorateSymbolName(name, UNDECORATION_NAME_ONLY);
+    } else {
+        image = image_name(IMG_FindByAddress(addr));
+    }
+    UINT32 result = 0;
+    if (matches_any(include_images, image) ||
+        matches_any(include_functions, name) ||
+        matches_any(include_functions, demangled))
+    {
+        result |= FILTER_INCLUDED;
+    }
+    if (matches_any(exclude_images, image) ||
+        matches_any(exclude_functions, name) ||
+        matches_any(exclude_functions, demangled))
+    {
+        result |= FILTER_EXCLUDED;
+    }
+    return result;
+}
+
+// The address of 'addr' in the main executable before relocation, which stays
+// the same across runs of a position-independent executable, or 0 if it isn't
+// in the main executable
+static ADDRINT main_image_offset(ADDRINT addr) {
+    IMG img = IMG_FindByAddress(addr);
+    if (!IMG_Valid(img) || !IMG_IsMainExecutable(img))
+        return 0;
+    return addr - IMG_LoadOffset(img);
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+// Whether the heap accesses made by 'ins' should be profiled. Address ranges
+// are matched against the main executable's unrelocated addresses, like the
+// call sites in the contexts file, so they hold across runs under ASLR.
+static bool is_profiled(INS ins) {
+    if (!enabled)
+        return true;
+    ADDRINT addr = INS_Address(ins);
+    RTN rtn = INS_Rtn(ins);
+    ADDRINT key = RTN_Valid(rtn) ? RTN_Address(rtn) : addr;
+    unordered_map<ADDRINT, UINT32>::iterator it = routine_filters.find(key);
+    if (it == routine_filters.end()) {
+        UINT32 matched = match_routine(rtn, addr);
+        it = routine_filters.insert(make_pair(key, matched)).first;
+    }
+    UINT32 filters = it->second;
+    ADDRINT offset = main_image_offset(addr);
+    if (offset && in_any(include_ranges, offset))
+        filters |= FILTER_INCLUDED;
+    if (offset && in_any(exclude_ranges, offset))
+        filters |= FILTER_EXCLUDED;
+    return (!has_includes || (filters & FILTER_INCLUDED)) &&
+           !(filters & FILTER_EXCLUDED);
+}
+
+static void initialize(void) {
+    include_images = parse_globs(KnobIncludeImages.Value());
+    exclude_images = parse_globs(KnobExcludeImages.Value());
+    include_functions = parse_globs(KnobIncludeFunctions.Value());
+    exclude_functions = parse_globs(KnobExcludeFunctions.Value());
+    include_ranges = parse_ranges(KnobIncludeRanges.Value());
+    exclude_ranges = parse_ranges(KnobExcludeRanges.Value());
+    if (KnobFilteredAccesses.Value() == "filler") {
+        filler = true;
+    } else if (KnobFilteredAccesses.Value() != "ignore") {
+        cerr << "ERROR: filtered accesses must be either 'ignore' or "
+                "'filler'\n";
+        PIN_ExitApplication(1);
+    }
+    has_includes = !include_images.empty() || !include_functions.empty() ||
+                   !include_ranges.empty();
+    enabled = has_includes || !exclude_images.empty() ||
+              !exclude_functions.empty() || !exclude_ranges.empty();
+}
+}
@@ -0,0 +1,491 @@
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+#define MIN_ACCESS_SIZE 4
+#define POPULAR_ACCESS_FRACTION 0.9
+
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+// An affinity window and the graph it feeds. Each thread has its own unless
+// cross-thread affinity is counted, in which case all threads share one. When
+// intervals are written, the window feeds 'interval_graph' instead, which is
+// folded into 'graph' at the end of each interval.
+struct AffinityState {
+    AffinityWindow window;
+    EdgeTable graph;
+    ObjectId last_touched_object;
+    UINT64 access_count;
+    UINT32 id;
+    UINT64 interval;
+    EdgeTable interval_graph;
+    vector<UINT64> interval_accesses;
+};
+
+// The affinity model, fed by heap accesses either as they happen (see
+// DynAccessTracer.h) or from a recorded heap trace (see halo-analyze.cpp).
+// Like the object table, it leaves locking to its callers.
+namespace DynAccessTracer {
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static UINT64 affinity_distance = 0;
+static UINT32 sample_objects = 1;
+static AffinityModel affinity_model = AFFINITY_BYTES;
+static UINT64 half_life = 0;
+
+// The most edges each graph keeps (0 for no limit), see EdgeTable
+static UINT64 max_edges = 0;
+
+// The merged results of every thread (or the shared state)
+static AffinityState affinity;
+static bool shared = false;
+
+// Extra distances to write graphs for. When there are any, each edge keeps a
+// histogram of the (log2) distances it was observed at.
+static vector<UINT32> distances;
+static UINT32 distance_buckets = 1;
+
+// Every live per-thread state
+static vector<AffinityState *> thread_states;
+static UINT32 next_state_id = 0;
+
+// The length of each interval in instructions (0 writes no intervals), and
+// where they're written
+static UINT64 interval_length = 0;
+static ofstream intervals;
+
+// Accesses within the traced heap range that hit no tracked object. These are
+// mostly accesses to objects allocated before halo-prof attached, whose
+// allocation context (and bounds) are unknown, so they're only counted. The
+// all-accesses model can't tell them apart from other non-heap accesses, so
+// they just age the window there.
+static UINT64 unknown_accesses = 0;
+
+/* ================================================================== */
+// Helper functions
+/* ================================================================== */
+
+static bool is_power_of_two(UINT64 n) {
+    return n && !(n & (n - 1));
+}
+
+static UINT32 floor_log2(UINT64 n) {
+    return 63 - __builtin_clzll(n);
+}
+
+static VOID parse_distances(const string &list) {
+    const char *str = list.c_str();
+    while (*str) {
+        char *end;
+        UINT64 distance = strtoul(str, &end, 0);
+        if (end == str || (*end && *end != ',') ||
+            !is_power_of_two(distance) || distance < MIN_ACCESS_SIZE ||
+            distance > affinity_distance)
+        {
+            cerr << "ERROR: affinity distances must be powers of two no "
+                    "larger than the affinity distance\n";
+            PIN_ExitApplication(1);
+        }
+        distances.push_back((UINT32)distance);
+        str = *end ? end + 1 : end;
+    }
+    if (!distances.empty())
+        distance_buckets = floor_log2(affinity_distance) + 1;
+}
+
+// Return the number of leading weight buckets of each edge that make up the
+// graph for affinity distance 'distance'
+static UINT32 buckets_within(UINT32 distance) {
+    return distance_buckets > 1 ? floor_log2(distance) + 1 : 1;
+}
+
+// Whether object 'id' is in the sampled subset
+static inline bool is_sampled(UINT64 id) {
+    return sample_objects == 1 ||
+           ((id * 0x9e3779b97f4a7c15ULL) >> 32) % sample_objects == 0;
+}
+
+static AffinityModel parse_model(const string &name) {
+    if (name == "bytes")
+        return AFFINITY_BYTES;
+    if (name == "all-accesses")
+        return AFFINITY_ALL_ACCESSES;
+    if (name == "lines")
+        return AFFINITY_LINES;
+    if (name == "decay")
+        return AFFINITY_DECAY;
+    cerr << "ERROR: affinity model must be 'bytes', 'all-accesses', 'lines' "
+            "or 'decay'\n";
+    PIN_ExitApplication(1);
+    return AFFINITY_BYTES;
+}
+
+static VOID affinity_state_init(AffinityState *state) {
+    affinity_window_init(&state->window, affinity_model, affinity_distance,
+                         affinity_distance / MIN_ACCESS_SIZE, half_life,
+                         CACHE_LINE_BITS);
+    state->window.field_profile = FieldProfile::enabled;
+    edge_table_init(&state->graph, EDGE_TABLE_INITIAL, distance_buckets);
+    if (max_edges)
+        edge_table_bound(&state->graph, max_edges);
+    state->last_touched_object = 0;
+    state->access_count = 0;
+    state->id = next_state_id++;
+    state->interval = 0;
+    if (interval_length) {
+        edge_table_init(&state->interval_graph, EDGE_TABLE_INITIAL,
+                        distance_buckets);
+        if (max_edges)
+            edge_table_bound(&state->interval_graph, max_edges);
+    }
+}
+
+// Write the accesses and edges the state saw during its current interval, in
+// the same form as a TGF file (with unscaled counts), then fold its edges
+// into the state's graph
+static VOID finish_interval(AffinityState *state) {
+    vector<UINT64> edges = edge_table_slots(&state->interval_graph, true);
+    intervals << "INTERVAL " << state->id << " " << state->interval << "\n";
+    for (size_t i = 0; i < state->interval_accesses.size(); ++i) {
+        if (state->interval_accesses[i])
+            intervals << i << " " << state->interval_accesses[i] << "\n";
+    }
+    intervals << "#\n";
+    UINT32 buckets = buckets_within(affinity_distance);
+    for (size_t i = 0; i < edges.size(); ++i) {
+        EdgeKey key = state->interval_graph.keys[edges[i]];
+        intervals << edge_src(key) << " " << edge_dst(key) << " "
+                  << edge_table_weight(&state->interval_graph, edges[i],
+                                       buckets) << "\n";
+    }
+    edge_table_merge(&state->graph, &state->interval_graph);
+    edge_table_clear(&state->interval_graph);
+    state->interval_accesses.assign(state->interval_accesses.size(), 0);
+}
+
+// Scale factor for the weights of edges between sampled objects, given the
+// one for node counts. Edges are only seen when both objects are sampled.
+static double sampled_edge_scale(double node_scale) {
+    return node_scale * sample_objects * sample_objects;
+}
+
+// Scale factor for edge weights in the locality graph, whose decayed weights
+// are fixed point
+static double edge_scale(double node_scale) {
+    double scale = sampled_edge_scale(node_scale);
+    return affinity_model == AFFINITY_DECAY ? scale / DECAY_SCALE : scale;
+}
+
+// Estimate a full count from a sampled one
+static UINT64 scale(UINT64 count, double factor) {
+    return (UINT64)(count * factor + 0.5);
+}
+
+// Return the TGF output filename for affinity distance 'distance', e.g.
+// 'locality-256.tgf'
+static string tgf_filename(const string &filename, UINT32 distance) {
+    string name = filename;
+    size_t dot = name.rfind('.');
+    if (dot == string::npos || name.find('/', dot) != string::npos)
+        dot = name.size();
+    ostringstream suffix;
+    suffix << "-" << distance;
+    return name.insert(dot, suffix.str());
+}
+
+// Write the locality graph made up of the first 'buckets' weight buckets of
+// each edge in 'edges'
+static VOID write_tgf(vector<AllocationContextId> &contexts,
+                      vector<UINT64> &edges, const string &filename,
+                      UINT32 buckets, double node_scale, double edge_scale)
+{
+    ofstream LocalityGraph;
+    LocalityGraph.open(filename.c_str());
+    LocalityGraph.setf(ios::showbase);
+
+    // Write nodes
+    for (vector<AllocationContextId>::iterator it = contexts.begin();
+         it != contexts.end(); ++it)
+    {
+        Context c = DynAllocTracer::contexts[*it];
+        if (!c.mark)
+            continue;
+        LocalityGraph << *it << " " << scale(c.access_count, node_scale)
+                      << "\n";
+    }
+    LocalityGraph << "#\n";
+
+    // Write edges (only those that were actually observed)
+    EdgeTable *graph = &affinity.graph;
+    for (vector<UINT64>::iterator it = edges.begin(); it != edges.end(); ++it) {
+        AllocationContextId i = edge_src(graph->keys[*it]);
+        AllocationContextId j = edge_dst(graph->keys[*it]);
+        UINT64 weight = edge_table_weight(graph, *it, buckets);
+        if (weight && DynAllocTracer::contexts[i].mark &&
+            DynAllocTracer::contexts[j].mark)
+        {
+            LocalityGraph << i << " " << j << " "
+                          << scale(weight, edge_scale) << "\n";
+        }
+    }
+    LocalityGraph.close();
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+static VOID configure(UINT64 distance, const string &distance_list,
+                      bool cross_thread, UINT32 sample_rate,
+                      UINT64 interval, const string &interval_filename,
+                      const string &model, UINT64 decay_half_life,
+                      UINT64 edge_limit)
+{
+    if (!is_power_of_two(distance)) {
+        cerr << "ERROR: affinity distance must be a power of two\n";
+        PIN_ExitApplication(1);
+    }
+    affinity_model = parse_model(model);
+    if (affinity_model == AFFINITY_LINES &&
+        distance < (2ULL << CACHE_LINE_BITS))
+    {
+        cerr << "ERROR: the lines affinity model needs an affinity distance "
+                "of at least two cache lines\n";
+        PIN_ExitApplication(1);
+    }
+    if (edge_limit == 1) {
+        cerr << "ERROR: edge limit must be at least two edges\n";
+        PIN_ExitApplication(1);
+    }
+    if (affinity_model == AFFINITY_DECAY && !decay_half_life) {
+        cerr << "ERROR: affinity half-life must be at least one "
+                "instruction\n";
+        PIN_ExitApplication(1);
+    }
+    if ((affinity_model == AFFINITY_LINES ||
+         affinity_model == AFFINITY_DECAY) && !distance_list.empty())
+    {
+        cerr << "ERROR: extra affinity distances are only supported by the "
+                "bytes and all-accesses models\n";
+        PIN_ExitApplication(1);
+    }
+    if (!sample_rate) {
+        cerr << "ERROR: object sampling rate must be at least one\n";
+        PIN_ExitApplication(1);
+    }
+
+    affinity_distance = distance;
+    sample_objects = sample_rate;
+    half_life = decay_half_life;
+    max_edges = edge_limit;
+    if (max_edges && FieldProfile::enabled)
+        FieldProfile::bound(max_edges);
+    parse_distances(distance_list);
+    if (interval) {
+        intervals.open(interval_filename.c_str());
+        if (!intervals) {
+            cerr << "ERROR: Failed to open interval output\n";
+            PIN_ExitApplication(1);
+        }
+        interval_length = interval;
+    }
+    shared = cross_thread;
+    affinity_state_init(&affinity);
+    if (shared)
+        thread_states.push_back(&affinity);
+}
+
+// Return the state a new thread should profile into
+static AffinityState *new_state(void) {
+    if (shared)
+        return &affinity;
+    AffinityState *state = new AffinityState();
+    affinity_state_init(state);
+    thread_states.push_back(state);
+    return state;
+}
+
+// Fold a finished thread's results into the merged graph
+static VOID retire_state(AffinityState *state) {
+    if (state == &affinity)
+        return;
+    thread_states.erase(find(thread_states.begin(), thread_states.end(),
+                             state));
+    if (interval_length) {
+        finish_interval(state);
+        edge_table_free(&state->interval_graph);
+    }
+    edge_table_merge(&affinity.graph, &state->graph);
+    affinity.access_count += state->access_count;
+    affinity_window_free(&state->window);
+    edge_table_free(&state->graph);
+    delete state;
+}
+
+// Objects may be linked or freed by any thread, so every window must be kept
+// in step
+static VOID object_linked(AllocationRecord *record) {
+    for (size_t i = 0; i < thread_states.size(); ++i)
+        affinity_window_update(&thread_states[i]->window, record);
+    PageGraph::object_linked(record);
+}
+
+static VOID object_freed(AllocationRecord *record) {
+    for (size_t i = 0; i < thread_states.size(); ++i)
+        affinity_window_remove(&thread_states[i]->window, record->id);
+    PageGraph::object_freed(record);
+}
+
+// Profile an access of 'size' bytes at 'addr' within 'obj' (in 'slot'), made
+// at instruction count 'time' (which only the decay model needs)
+static VOID profile_access(AffinityState *state, ObjectSlot slot,
+                           AllocationRecord *obj, ADDRINT addr, INT32 size,
+                           UINT64 time)
+{
+    ContextReport::object_accessed(obj, addr);
+    CacheSim::object_accessed(slot, obj, addr, size);
+    FieldProfile::object_accessed(obj, addr);
+    if (PageGraph::enabled)
+        PageGraph::object_accessed(obj, addr, size, is_sampled(obj->id));
+
+    if (obj->id == state->last_touched_object) {
+        affinity_window_repeat(&state->window, addr, size, time);
+    } else {
+        ++state->access_count;
+        __sync_fetch_and_add(
+            &DynAllocTracer::contexts[obj->context].access_count, 1);
+        if (interval_length) {
+            if (obj->context >= state->interval_accesses.size())
+                state->interval_accesses.resize(obj->context + 1, 0);
+            ++state->interval_accesses[obj->context];
+        }
+        if (is_sampled(obj->id)) {
+            // Only the line of the first access in a run is counted towards
+            // line pairs
+            UINT32 line = (UINT32)((addr - obj->addr) >> CACHE_LINE_BITS);
+            affinity_window_access(&state->window, obj, addr, size, line,
+                                   time, interval_length
+                                             ? &state->interval_graph
+                                             : &state->graph);
+        } else {
+            affinity_window_skip(&state->window, addr, size, time);
+        }
+        state->last_touched_object = obj->id;
+    }
+}
+
+// Finish the state's interval if the instruction count 'time' of one of the
+// threads feeding it has passed its end. Intervals in which the state saw no
+// clock records are skipped.
+static VOID advance_clock(AffinityState *state, UINT64 time) {
+    if (!interval_length || time / interval_length <= state->interval)
+        return;
+    finish_interval(state);
+    state->interval = time / interval_length;
+}
+
+// Process a batch of heap events made by one thread in program order. Runs
+// of accesses to the same object (the common case) reuse the previous lookup.
+// Accesses only know the time of the latest clock record, so the decay model
+// is only as precise as the clock records are frequent.
+static VOID process_records(AffinityState *state, const TraceRecord *records,
+                            UINT64 count)
+{
+    ObjectSlot slot = 0;
+    AllocationRecord *obj = NULL;
+    UINT64 time = 0;
+    for (const TraceRecord *r = records; r != records + count; ++r) {
+        if (r->type == TRACE_CLOCK) {
+            time = r->addr;
+            advance_clock(state, time);
+            continue;
+        }
+        if (r->type != TRACE_READ && r->type != TRACE_WRITE &&
+            r->type != TRACE_SKIP)
+        {
+            DynAllocTracer::process_event(r, time);
+            obj = NULL;
+            continue;
+        }
+        if (!obj || !DynAllocTracer::in_bounds(r->addr, obj->addr, obj->size)) {
+            slot = DynAllocTracer::allocation_slot(r->addr);
+            obj = slot ? DynAllocTracer::object_at(slot) : NULL;
+        }
+        if (obj && r->type != TRACE_SKIP)
+            profile_access(state, slot, obj, r->addr, r->size, time);
+        else if (obj || affinity_model == AFFINITY_ALL_ACCESSES)
+            affinity_window_skip(&state->window, r->addr, r->size, time);
+        else if (r->type != TRACE_SKIP)
+            __sync_fetch_and_add(&unknown_accesses, 1);
+    }
+}
+
+// Mark the most frequently accessed contexts (those making up 90% of all
+// accesses), then write the locality graph for the full affinity distance to
+// 'filename', followed by one for each smaller distance. Counts are scaled up
+// by 'node_scale' to estimate those of an unsampled run.
+static VOID write_locality_graphs(const string &filename, bool sort_edges,
+                                  double node_scale)
+{
+    // The shared state is never retired, so finish its last interval here
+    if (interval_length) {
+        if (shared)
+            finish_interval(&affinity);
+        edge_table_free(&affinity.interval_graph);
+        intervals.close();
+    }
+
+    // Sort allocation contexts by access frequency
+    vector<AllocationContextId> contexts = DynAllocTracer::context_ids();
+    sort(contexts.begin(), contexts.end(),
+         DynAllocTracer::sort_contexts_by_accesses);
+
+    // Mark popular nodes
+    UINT64 accesses = 0;
+    UINT64 total = affinity.access_count;
+    UINT64 threshold = (UINT64)(((double)total) * POPULAR_ACCESS_FRACTION);
+    for (vector<AllocationContextId>::iterator it = contexts.begin();
+         it != contexts.end(); ++it)
+    {
+        Context *c = &DynAllocTracer::contexts[*it];
+
+        // Stop marking nodes as popular once the access threshold is reached
+        c->mark = 1;
+        accesses += c->access_count;
+        if (accesses >= threshold)
+            break;
+    }
+
+    vector<UINT64> edges = edge_table_slots(&affinity.graph, sort_edges);
+    write_tgf(contexts, edges, filename, buckets_within(affinity_distance),
+              node_scale, edge_scale(node_scale));
+    for (size_t i = 0; i < distances.size(); ++i) {
+        write_tgf(contexts, edges, tgf_filename(filename, distances[i]),
+                  buckets_within(distances[i]), node_scale,
+                  edge_scale(node_scale));
+    }
+    cerr << "Generated locality graph accounting for " << accesses << " out of "
+         << total << " unique object accesses" << endl;
+    if (unknown_accesses) {
+        cerr << "Ignored " << unknown_accesses << " heap accesses to objects "
+                "of unknown context" << endl;
+    }
+
+    // Count-min estimates overcount by at most e/width of the sketch's weight
+    // with probability 1 - e^-depth
+    const EdgeTable *graph = &affinity.graph;
+    if (graph->evicted) {
+        cerr << "Kept the " << graph->size << " heaviest affinity edges, "
+                "folding lighter edges weighing " << graph->evicted
+             << " (unscaled) into a sketch. Kept edge weights may be "
+                "overestimated by up to "
+             << (UINT64)(graph->evicted * M_E / graph->sketch_width)
+             << " each (with probability 1 - e^-" << EDGE_SKETCH_DEPTH
+             << ")." << endl;
+    }
+}
+}
@@ -0,0 +1,374 @@
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+// What the affinity distance is measured in:
+//  - bytes of distinct heap object accesses (repeated accesses to the same
+//    object, and accesses to anything else, don't count)
+//  - bytes of every memory access, including repeated, stack and global ones
+//  - distinct cache lines accessed, i.e. LRU reuse distance
+//  - instructions executed, with edges weighted down the further apart the
+//    two accesses were
+enum AffinityModel {
+    AFFINITY_BYTES,
+    AFFINITY_ALL_ACCESSES,
+    AFFINITY_LINES,
+    AFFINITY_DECAY
+};
+
+// The set of distinct live objects accessed within the affinity distance of
+// the present, stored as a structure of arrays. Each object carries a copy of
+// its context and co-allocation links so that a new access can be checked
+// against the whole window without touching the object table.
+//
+// Objects are aged by two clocks: the distance since their most recent
+// access, in the units of the window's model, and the number of (distinct
+// object) accesses since. The cache line of each object's most recent access
+// is kept for the field profile (FieldProfile.h).
+//
+// Objects are kept in no particular order. 'index' is an open-addressed hash
+// table mapping each object's id to its position plus one (zero marks an
+// empty slot), so that links and frees find an object without a search.
+//
+// The lines model keeps the most recently accessed distinct lines (cache
+// lines, or pages for the page graph) as an LRU stack, each stamped with the
+// clock at its last access. Its clock counts
+// accesses, and an object stays in the window for as long as the stack still
+// holds a line accessed no earlier than it was.
+struct AffinityWindow {
+    AffinityModel model;
+    UINT64 size;
+    UINT64 capacity;
+    UINT64 max_distance;
+    UINT64 max_accesses;
+    UINT64 clock;
+    UINT64 accesses;
+    ObjectId *ids;
+    AllocationContextId *contexts;
+    ObjectId *predecessors;
+    ObjectId *successors;
+    UINT64 *last_clock;
+    UINT64 *last_access;
+    UINT32 *lines;
+    UINT8 *flags;
+    UINT64 *index;
+    UINT64 index_mask;
+    bool field_profile;
+    UINT64 half_life;
+    UINT32 line_bits;
+    UINT64 num_lru_lines;
+    UINT64 max_lru_lines;
+    ADDRINT *lru_lines;
+    UINT64 *lru_stamps;
+};
+
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+#define WINDOW_LIVE 1
+#define WINDOW_HIT  2
+#define WINDOW_NONE (~0ULL)
+
+// Edge weights in the decay model are fixed point, halving every half-life
+// until they reach zero
+#define DECAY_BITS  8
+#define DECAY_SCALE (1ULL << DECAY_BITS)
+
+// Buffered and recorded accesses are timed by the latest clock tick, of which
+// the decay model needs several per half-life
+#define DECAY_TICKS_PER_HALF_LIFE 4
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+template <typename T>
+static T *affinity_window_array(UINT64 n) {
+    T *result = (T *)calloc(n, sizeof(T));
+    if (!result) {
+        cerr << "ERROR: Failed to allocate affinity window\n";
+        PIN_ExitApplication(1);
+    }
+    return result;
+}
+
+// Set up a window holding objects accessed within 'max_distance' bytes (or
+// that many bytes of distinct 2^line_bits byte lines, or 'half_life'
+// instructions for each step of decay) and 'max_accesses' accesses of the
+// present
+static VOID affinity_window_init(AffinityWindow *w, AffinityModel model,
+                                 UINT64 max_distance, UINT64 max_accesses,
+                                 UINT64 half_life, UINT32 line_bits)
+{
+    memset(w, 0, sizeof(*w));
+    w->model = model;
+    w->line_bits = line_bits;
+    w->capacity = max_accesses;
+    w->max_distance = max_distance;
+    w->max_accesses = max_accesses;
+    if (model == AFFINITY_LINES) {
+        w->max_distance = ~0ULL;
+        w->max_lru_lines = max_distance >> line_bits;
+        w->lru_lines = affinity_window_array<ADDRINT>(w->max_lru_lines);
+        w->lru_stamps = affinity_window_array<UINT64>(w->max_lru_lines);
+    } else if (model == AFFINITY_DECAY) {
+        w->half_life = half_life;
+        w->max_distance = half_life * (DECAY_BITS + 1);
+    }
+    w->ids = affinity_window_array<ObjectId>(w->capacity);
+    w->contexts = affinity_window_array<AllocationContextId>(w->capacity);
+    w->predecessors = affinity_window_array<ObjectId>(w->capacity);
+    w->successors = affinity_window_array<ObjectId>(w->capacity);
+    w->last_clock = affinity_window_array<UINT64>(w->capacity);
+    w->last_access = affinity_window_array<UINT64>(w->capacity);
+    w->lines = affinity_window_array<UINT32>(w->capacity);
+    w->flags = affinity_window_array<UINT8>(w->capacity);
+
+    UINT64 index_size = 2;
+    while (index_size < 2 * w->capacity)
+        index_size <<= 1;
+    w->index = affinity_window_array<UINT64>(index_size);
+    w->index_mask = index_size - 1;
+}
+
+static VOID affinity_window_free(AffinityWindow *w) {
+    free(w->ids);
+    free(w->contexts);
+    free(w->predecessors);
+    free(w->successors);
+    free(w->last_clock);
+    free(w->last_access);
+    free(w->lines);
+    free(w->flags);
+    free(w->index);
+    free(w->lru_lines);
+    free(w->lru_stamps);
+    memset(w, 0, sizeof(*w));
+}
+
+static VOID affinity_window_move(AffinityWindow *w, UINT64 from, UINT64 to) {
+    w->ids[to] = w->ids[from];
+    w->contexts[to] = w->contexts[from];
+    w->predecessors[to] = w->predecessors[from];
+    w->successors[to] = w->successors[from];
+    w->last_clock[to] = w->last_clock[from];
+    w->last_access[to] = w->last_access[from];
+    w->lines[to] = w->lines[from];
+    w->flags[to] = w->flags[from];
+}
+
+// Return the index slot holding 'id', or the empty slot where it would go
+static inline UINT64 affinity_window_slot(const AffinityWindow *w,
+                                          ObjectId id)
+{
+    UINT64 ix = edge_table_hash(id) & w->index_mask;
+    while (w->index[ix] && w->ids[w->index[ix] - 1] != id)
+        ix = (ix + 1) & w->index_mask;
+    return ix;
+}
+
+// Drop the object at position 'i', moving the last object into its place.
+// Later index entries are shifted back over the freed slot, so that no probe
+// sequence is broken.
+static VOID affinity_window_drop(AffinityWindow *w, UINT64 i) {
+    UINT64 mask = w->index_mask;
+    UINT64 hole = affinity_window_slot(w, w->ids[i]);
+    for (UINT64 ix = (hole + 1) & mask; w->index[ix]; ix = (ix + 1) & mask) {
+        UINT64 home = edge_table_hash(w->ids[w->index[ix] - 1]) & mask;
+        if (((ix - home) & mask) >= ((ix - hole) & mask)) {
+            w->index[hole] = w->index[ix];
+            hole = ix;
+        }
+    }
+    w->index[hole] = 0;
+
+    UINT64 last = --w->size;
+    if (i != last) {
+        affinity_window_move(w, last, i);
+        w->index[affinity_window_slot(w, w->ids[i])] = i + 1;
+    }
+}
+
+// Return the smallest k such that the object in 'slot' would still be in the
+// window if the affinity distance were 2^k bytes (keeping the same ratio of
+// distance to accesses)
+static inline UINT32 affinity_window_bucket(const AffinityWindow *w,
+                                            UINT64 slot)
+{
+    UINT64 distance = w->clock - w->last_clock[slot];
+    UINT64 accesses = (w->accesses - w->last_access[slot]) *
+                      (w->max_distance / w->max_accesses);
+    UINT64 span = std::max(distance, accesses);
+    return span ? 64 - __builtin_clzll(span) : 0;
+}
+
+// Move the line holding 'addr' to the top of the LRU stack, and let objects
+// stay in the window only while a line at least as recent as theirs is still
+// in it
+static VOID affinity_window_touch_line(AffinityWindow *w, ADDRINT addr) {
+    ADDRINT line = addr >> w->line_bits;
+    UINT64 i = 0;
+    while (i < w->num_lru_lines && w->lru_lines[i] != line)
+        ++i;
+    if (i == w->num_lru_lines && w->num_lru_lines < w->max_lru_lines)
+        ++w->num_lru_lines;
+    else if (i == w->num_lru_lines)
+        --i;
+    memmove(w->lru_lines + 1, w->lru_lines, i * sizeof(*w->lru_lines));
+    memmove(w->lru_stamps + 1, w->lru_stamps, i * sizeof(*w->lru_stamps));
+    w->lru_lines[0] = line;
+    w->lru_stamps[0] = w->clock;
+    if (w->num_lru_lines == w->max_lru_lines)
+        w->max_distance = w->clock - w->lru_stamps[w->num_lru_lines - 1];
+}
+
+// Bring the window's clock up to an access to 'addr' made at instruction
+// count 'time', before it's compared with the objects in the window
+static inline VOID affinity_window_tick(AffinityWindow *w, ADDRINT addr,
+                                        UINT64 time)
+{
+    if (w->model == AFFINITY_LINES)
+        affinity_window_touch_line(w, addr);
+    else if (w->model == AFFINITY_DECAY)
+        w->clock = std::max(w->clock, time);
+}
+
+// Move the window's clock past an access of 'size' bytes
+static inline VOID affinity_window_advance(AffinityWindow *w, INT32 size) {
+    if (w->model == AFFINITY_LINES)
+        ++w->clock;
+    else if (w->model != AFFINITY_DECAY)
+        w->clock += size;
+}
+
+// The weight of an edge to the object in 'slot'
+static inline UINT64 affinity_window_weight(const AffinityWindow *w,
+                                            UINT64 slot)
+{
+    if (!w->half_life)
+        return 1;
+    return DECAY_SCALE >> ((w->clock - w->last_clock[slot]) / w->half_life);
+}
+
+static inline UINT64 affinity_window_find(const AffinityWindow *w,
+                                          ObjectId id)
+{
+    UINT64 position = w->index[affinity_window_slot(w, id)];
+    return position ? position - 1 : WINDOW_NONE;
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+// Add an edge to 'graph' for every other object in the window that 'obj' can
+// be co-allocated with, then record the access (of 'size' bytes at 'addr',
+// cache line 'line' of the object, made at instruction count 'time'). Hits
+// feed the field profile if the window's 'field_profile' is set. If
+// 'graph' has more than one weight per edge, edges are bucketed by
+// affinity_window_bucket.
+static VOID affinity_window_access(AffinityWindow *w, AllocationRecord *obj,
+                                   ADDRINT addr, INT32 size, UINT32 line,
+                                   UINT64 time, EdgeTable *graph)
+{
+    affinity_window_tick(w, addr, time);
+    ObjectId a = obj->id;
+    ObjectId a_pred = obj->predecessor;
+    ObjectId a_succ = obj->successor;
+    UINT64 n = w->size;
+
+    // Classify every object in one branch-free pass over the window. Objects
+    // are co-allocatable if no other object from either context was allocated
+    // between them.
+    for (UINT64 i = 0; i < n; ++i) {
+        ObjectId b = w->ids[i];
+        UINT8 live = (w->clock - w->last_clock[i] < w->max_distance) &
+                     (w->accesses - w->last_access[i] < w->max_accesses);
+        bool a_first = a < b;
+        ObjectId lo = a_first ? a : b;
+        ObjectId hi = a_first ? b : a;
+        ObjectId lo_succ = a_first ? a_succ : w->successors[i];
+        ObjectId hi_pred = a_first ? w->predecessors[i] : a_pred;
+        UINT8 coallocatable = (b != a) & (!lo_succ | (lo_succ >= hi)) &
+                              (!hi_pred | (hi_pred <= lo));
+        w->flags[i] = live | ((live & coallocatable) << 1);
+    }
+
+    // Count affinity with each hit, dropping objects that have aged out
+    UINT64 self = WINDOW_NONE;
+    for (UINT64 i = 0; i < w->size;) {
+        UINT8 flags = w->flags[i];
+        if (!(flags & WINDOW_LIVE)) {
+            affinity_window_drop(w, i);
+            continue;
+        }
+        if (flags & WINDOW_HIT) {
+            UINT32 bucket = 0;
+            if (graph->stride > 1)
+                bucket = affinity_window_bucket(w, i);
+            edge_table_add(graph, obj->context, w->contexts[i], bucket,
+                           affinity_window_weight(w, i));
+            if (w->field_profile) {
+                FieldProfile::lines_accessed(obj->context, line,
+                                             w->contexts[i], w->lines[i]);
+            }
+        }
+        if (w->ids[i] == a)
+            self = i;
+        ++i;
+    }
+
+    // Record the access
+    if (self == WINDOW_NONE) {
+        self = w->size++;
+        w->ids[self] = a;
+        w->contexts[self] = obj->context;
+        w->predecessors[self] = a_pred;
+        w->successors[self] = a_succ;
+        w->index[affinity_window_slot(w, a)] = self + 1;
+    }
+    affinity_window_advance(w, size);
+    w->last_clock[self] = w->clock;
+    w->last_access[self] = w->accesses++;
+    w->lines[self] = line;
+}
+
+// Age the window by an access that doesn't take part in affinity
+static inline VOID affinity_window_skip(AffinityWindow *w, ADDRINT addr,
+                                        INT32 size, UINT64 time)
+{
+    affinity_window_tick(w, addr, time);
+    affinity_window_advance(w, size);
+    ++w->accesses;
+}
+
+// Age the window by a repeated access to the object accessed last, which
+// only counts in the models measuring every access or every line
+static inline VOID affinity_window_repeat(AffinityWindow *w, ADDRINT addr,
+                                          INT32 size, UINT64 time)
+{
+    if (w->model == AFFINITY_ALL_ACCESSES)
+        affinity_window_skip(w, addr, size, time);
+    else if (w->model == AFFINITY_LINES)
+        affinity_window_touch_line(w, addr);
+}
+
+// Refresh the cached context and co-allocation links of 'record'
+static VOID affinity_window_update(AffinityWindow *w,
+                                   AllocationRecord *record)
+{
+    UINT64 i = affinity_window_find(w, record->id);
+    if (i == WINDOW_NONE)
+        return;
+    w->contexts[i] = record->context;
+    w->predecessors[i] = record->predecessor;
+    w->successors[i] = record->successor;
+}
+
+// Drop an object that is no longer live
+static VOID affinity_window_remove(AffinityWindow *w, ObjectId id) {
+    UINT64 i = affinity_window_find(w, id);
+    if (i != WINDOW_NONE)
+        affinity_window_drop(w, i);
+}
@@ -0,0 +1,212 @@
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+#if defined(TARGET_MAC)
+#define SYMBOL_PREFIX "_"
+#else
+#define SYMBOL_PREFIX ""
+#endif
+
+#define NO_ARG (-1)
+
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+enum AllocatorKind {
+    ALLOCATOR_ALLOC,
+    ALLOCATOR_REALLOC,
+    ALLOCATOR_FREE
+};
+
+// A function that allocates, reallocates or frees heap objects, and the
+// (zero-based) positions of its arguments. The size of a new object is its
+// size argument times its count argument (if any), and its address is the
+// return value unless it's written through the dest argument instead. The
+// ptr argument is the object freed, or the one resized by a reallocator
+// (which frees it if the object moves).
+struct Allocator {
+    string name;
+    AllocatorKind kind;
+    INT32 size_arg;
+    INT32 count_arg;
+    INT32 ptr_arg;
+    INT32 dest_arg;
+};
+
+struct BuiltinAllocator {
+    const char *name;
+    AllocatorKind kind;
+    INT32 size_arg;
+    INT32 count_arg;
+    INT32 ptr_arg;
+    INT32 dest_arg;
+};
+
+// The C allocation functions and the (Itanium ABI mangled) replaceable C++
+// allocation and deallocation functions, including their nothrow, sized and
+// aligned variants
+static const BuiltinAllocator builtin_allocators[] = {
+    { "malloc",
+      ALLOCATOR_ALLOC, 0, NO_ARG, NO_ARG, NO_ARG },
+    { "calloc",
+      ALLOCATOR_ALLOC, 1, 0, NO_ARG, NO_ARG },
+    { "posix_memalign",
+      ALLOCATOR_ALLOC, 2, NO_ARG, NO_ARG, 0 },
+    { "aligned_alloc",
+      ALLOCATOR_ALLOC, 1, NO_ARG, NO_ARG, NO_ARG },
+    { "realloc",
+      ALLOCATOR_REALLOC, 1, NO_ARG, 0, NO_ARG },
+    { "free",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_Znwm",
+      ALLOCATOR_ALLOC, 0, NO_ARG, NO_ARG, NO_ARG },
+    { "_Znam",
+      ALLOCATOR_ALLOC, 0, NO_ARG, NO_ARG, NO_ARG },
+    { "_ZnwmRKSt9nothrow_t",
+      ALLOCATOR_ALLOC, 0, NO_ARG, NO_ARG, NO_ARG },
+    { "_ZnamRKSt9nothrow_t",
+      ALLOCATOR_ALLOC, 0, NO_ARG, NO_ARG, NO_ARG },
+    { "_ZnwmSt11align_val_t",
+      ALLOCATOR_ALLOC, 0, NO_ARG, NO_ARG, NO_ARG },
+    { "_ZnamSt11align_val_t",
+      ALLOCATOR_ALLOC, 0, NO_ARG, NO_ARG, NO_ARG },
+    { "_ZnwmSt11align_val_tRKSt9nothrow_t",
+      ALLOCATOR_ALLOC, 0, NO_ARG, NO_ARG, NO_ARG },
+    { "_ZnamSt11align_val_tRKSt9nothrow_t",
+      ALLOCATOR_ALLOC, 0, NO_ARG, NO_ARG, NO_ARG },
+    { "_ZdlPv",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdaPv",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdlPvRKSt9nothrow_t",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdaPvRKSt9nothrow_t",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdlPvm",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdaPvm",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdlPvSt11align_val_t",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdaPvSt11align_val_t",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdlPvmSt11align_val_t",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdaPvmSt11align_val_t",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdlPvSt11align_val_tRKSt9nothrow_t",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+    { "_ZdaPvSt11align_val_tRKSt9nothrow_t",
+      ALLOCATOR_FREE, NO_ARG, NO_ARG, 0, NO_ARG },
+};
+
+// The functions traced as allocators, both by the shadow stack (which treats
+// each as a leaf of the call chain) and by DynAllocTracer
+namespace Allocators {
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+
+KNOB<string> KnobAllocators(KNOB_MODE_WRITEONCE, "pintool", "allocators", "",
+    "comma-separated list of extra allocator functions, each given as "
+    "'name:kind[:arg=index]...', where kind is alloc, realloc or free and "
+    "args are size, count, ptr and dest (e.g. "
+    "'pool_alloc:alloc:size=1,pool_free:free:ptr=1')");
+
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+// Never changes once instrumentation starts, so that analysis routines can
+// be passed pointers into it
+static vector<Allocator> functions;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static VOID invalid_allocator(const string &spec, const char *reason) {
+    cerr << "ERROR: Invalid allocator '" << spec << "': " << reason << "\n";
+    PIN_ExitApplication(1);
+}
+
+// Parse one 'name:kind[:arg=index]...' allocator description
+static Allocator parse_allocator(const string &spec) {
+    vector<string> fields;
+    size_t start = 0;
+    for (;;) {
+        size_t end = spec.find(':', start);
+        fields.push_back(spec.substr(start, end - start));
+        if (end == string::npos)
+            break;
+        start = end + 1;
+    }
+    if (fields.size() < 2 || fields[0].empty())
+        invalid_allocator(spec, "expected 'name:kind[:arg=index]...'");
+
+    Allocator a;
+    a.name = fields[0];
+    a.size_arg = a.count_arg = a.ptr_arg = a.dest_arg = NO_ARG;
+    if (fields[1] == "alloc")
+        a.kind = ALLOCATOR_ALLOC;
+    else if (fields[1] == "realloc")
+        a.kind = ALLOCATOR_REALLOC;
+    else if (fields[1] == "free")
+        a.kind = ALLOCATOR_FREE;
+    else
+        invalid_allocator(spec, "kind must be alloc, realloc or free");
+
+    for (size_t i = 2; i < fields.size(); ++i) {
+        size_t equals = fields[i].find('=');
+        string arg = fields[i].substr(0, equals);
+        char *end;
+        const char *index = fields[i].c_str() + equals + 1;
+        INT32 value = (INT32)strtol(index, &end, 0);
+        if (equals == string::npos || end == index || *end || value < 0)
+            invalid_allocator(spec, "arguments must be given as 'arg=index'");
+        if (arg == "size")
+            a.size_arg = value;
+        else if (arg == "count")
+            a.count_arg = value;
+        else if (arg == "ptr")
+            a.ptr_arg = value;
+        else if (arg == "dest")
+            a.dest_arg = value;
+        else
+            invalid_allocator(spec, "args must be size, count, ptr or dest");
+    }
+    if (a.kind != ALLOCATOR_FREE && a.size_arg == NO_ARG)
+        invalid_allocator(spec, "allocators must have a size argument");
+    if (a.kind == ALLOCATOR_FREE && a.ptr_arg == NO_ARG)
+        invalid_allocator(spec, "deallocators must have a ptr argument");
+    return a;
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+static void initialize(void) {
+    size_t n = sizeof(builtin_allocators) / sizeof(builtin_allocators[0]);
+    for (size_t i = 0; i < n; ++i) {
+        const BuiltinAllocator *b = &builtin_allocators[i];
+        Allocator a = { string(SYMBOL_PREFIX) + b->name, b->kind, b->size_arg,
+                        b->count_arg, b->ptr_arg, b->dest_arg };
+        functions.push_back(a);
+    }
+
+    const string &list = KnobAllocators.Value();
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos)
+            end = list.size();
+        if (end > start)
+            functions.push_back(parse_allocator(list.substr(start,
+                                                            end - start)));
+        start = end + 1;
+    }
+}
+}
@@ -0,0 +1,135 @@
+// Lets halo-prof attach to a process that is already running (pin -pid) and
+// detach again once it has profiled enough, writing its outputs as if the
+// process had exited. Pin reports threads that were already running when it
+// attached, and threads still running when it detaches, through different
+// callbacks to those for threads starting and exiting, and doesn't run fini
+// functions on detaching, so every module registers its per-thread and fini
+// functions here instead.
+namespace Attach {
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+
+KNOB<UINT32> KnobProfileSeconds(KNOB_MODE_WRITEONCE, "pintool",
+    "profile-seconds", "0", "stop profiling after this many seconds, "
+    "detaching from the process if attached to it and exiting otherwise");
+
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+#define TIMER_POLL_MS 100
+
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static bool attached = false;
+static volatile INT32 stopping = 0;
+
+static vector<THREAD_START_CALLBACK> thread_starts;
+static vector<THREAD_FINI_CALLBACK> thread_finis;
+static vector<PREPARE_FOR_FINI_CALLBACK> prepare_functions;
+static vector<FINI_CALLBACK> fini_functions;
+
+// The timer thread sets 'expired' for application threads to notice (see
+// DynAllocTracer::trace_bbl_executed), as Pin only detaches or exits from
+// application threads. It polls 'finished' so that it can be stopped at exit.
+static volatile bool expired = false;
+static volatile bool finished = false;
+static PIN_THREAD_UID timer_uid;
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+static VOID add_thread_functions(THREAD_START_CALLBACK start,
+                                 THREAD_FINI_CALLBACK fini)
+{
+    PIN_AddThreadStartFunction(start, 0);
+    PIN_AddThreadFiniFunction(fini, 0);
+    thread_starts.push_back(start);
+    thread_finis.push_back(fini);
+}
+
+static VOID add_prepare_for_fini_function(PREPARE_FOR_FINI_CALLBACK fn) {
+    PIN_AddPrepareForFiniFunction(fn, 0);
+    prepare_functions.push_back(fn);
+}
+
+static VOID add_fini_function(FINI_CALLBACK fn) {
+    PIN_AddFiniFunction(fn, 0);
+    fini_functions.push_back(fn);
+}
+
+// End the profile, once, from an application thread
+static VOID stop(void) {
+    if (!__sync_bool_compare_and_swap(&stopping, 0, 1))
+        return;
+    if (attached)
+        PIN_Detach();
+    else
+        PIN_ExitApplication(0);
+}
+
+/* ===================================================================== */
+// Analysis functions
+/* ===================================================================== */
+
+static VOID timer(VOID *arg) {
+    UINT64 remaining = (UINT64)KnobProfileSeconds.Value() * 1000;
+    while (!finished && remaining) {
+        UINT64 ms = std::min(remaining, (UINT64)TIMER_POLL_MS);
+        PIN_Sleep((UINT32)ms);
+        remaining -= ms;
+    }
+    expired = !finished;
+    PIN_ExitThread(0);
+}
+
+/* ===================================================================== */
+// Instrumentation functions
+/* ===================================================================== */
+
+static VOID thread_attach(THREADID tid, CONTEXT *ctxt, VOID *v) {
+    for (size_t i = 0; i < thread_starts.size(); ++i)
+        thread_starts[i](tid, ctxt, 0, 0);
+}
+
+static VOID thread_detach(THREADID tid, const CONTEXT *ctxt, VOID *v) {
+    for (size_t i = 0; i < thread_finis.size(); ++i)
+        thread_finis[i](tid, ctxt, 0, 0);
+}
+
+static VOID prepare_for_fini(VOID *v) {
+    finished = true;
+    if (KnobProfileSeconds.Value())
+        PIN_WaitForThreadTermination(timer_uid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+// Every thread has been detached, so finish up as if the process had exited
+static VOID detach(VOID *v) {
+    finished = true;
+    for (size_t i = 0; i < prepare_functions.size(); ++i)
+        prepare_functions[i](0);
+    for (size_t i = 0; i < fini_functions.size(); ++i)
+        fini_functions[i](0, 0);
+}
+
+// NOTE: Call this before any other module is initialized
+static void initialize(void) {
+    attached = PIN_IsAttaching();
+    PIN_AddThreadAttachFunction(thread_attach, 0);
+    PIN_AddThreadDetachFunction(thread_detach, 0);
+    PIN_AddDetachFunction(detach, 0);
+    if (!KnobProfileSeconds.Value())
+        return;
+    if (PIN_SpawnInternalThread(timer, NULL, 0, &timer_uid) ==
+        INVALID_THREADID)
+    {
+        cerr << "ERROR: Failed to start profiling timer thread\n";
+        PIN_ExitApplication(1);
+    }
+    PIN_AddPrepareForFiniFunction(prepare_for_fini, 0);
+}
+}
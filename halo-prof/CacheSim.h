@@ -0,0 +1,346 @@
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+#define CACHE_SIM_LEVELS  3 // L1, L2 and the data TLB
+#define CACHE_SIM_LAYOUTS 2 // As allocated, and as libhalo would group them
+#define PAGE_BITS         12
+
+// libhalo's allocator parameters (see libhalo/allocate.h). Grouped objects are
+// placed in a slab above the user address space so they can't collide with
+// the real heap.
+#define HALO_CHUNK_HEADER_SIZE 64
+#define HALO_ALIGNMENT         8
+#define HALO_SLAB_BASE         (1ULL << 47)
+
+enum CacheLayout {
+    LAYOUT_BASELINE,
+    LAYOUT_GROUPED
+};
+
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+// A set-associative cache of 2^block_bits byte blocks with LRU replacement.
+// Tags hold the block number plus one, so that zero means 'invalid'.
+struct CacheLevel {
+    UINT32 sets, ways;
+    UINT32 block_bits;
+    vector<UINT64> tags;
+    vector<UINT64> stamps;
+    UINT64 clock;
+};
+
+struct CacheStats {
+    UINT64 accesses;
+    UINT64 misses[CACHE_SIM_LAYOUTS][CACHE_SIM_LEVELS];
+};
+
+// The bump pointer of a libhalo group (zero until it has a chunk)
+struct HaloGroup {
+    ADDRINT curr;
+};
+
+// Simulates the cache behaviour of heap accesses, attributing misses to the
+// allocation context of the object accessed. Given a groups file, the same
+// accesses are replayed against a second hierarchy in which the objects of
+// grouped contexts have been moved to where libhalo's bump allocator would
+// have put them, predicting the benefit of the grouping. Only accesses to
+// tracked objects are simulated, and ungrouped objects keep their addresses.
+// Kept in step with the object table, under the same locking.
+namespace CacheSim {
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static bool enabled = false;
+static bool grouped = false;
+static CacheLevel levels[CACHE_SIM_LAYOUTS][CACHE_SIM_LEVELS];
+static vector<CacheStats> stats;
+
+// The group each context belongs to (or -1), from the groups file
+static vector<INT32> context_groups;
+
+// The emulated libhalo heap: the address of each grouped object (by slot),
+// the live objects in each chunk and the group it was last allocated to
+static UINT64 chunk_size = 0;
+static UINT64 max_spare_chunks = 0;
+static vector<HaloGroup> groups;
+static vector<ADDRINT> remapped;
+static vector<UINT64> chunk_live;
+static vector<INT32> chunk_group;
+static vector<ADDRINT> spare_chunks;
+static ADDRINT slab_ptr = HALO_SLAB_BASE;
+
+static const char *level_names[CACHE_SIM_LEVELS] = { "l1", "l2", "tlb" };
+static const char *layout_names[CACHE_SIM_LAYOUTS] = { "baseline", "grouped" };
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static VOID cache_level_init(CacheLevel *level, UINT64 blocks, UINT32 ways,
+                             UINT32 block_bits)
+{
+    UINT64 sets = ways ? blocks / ways : 0;
+    if (!sets || sets * ways != blocks || (sets & (sets - 1))) {
+        cerr << "ERROR: cache geometry must give a power-of-two number of "
+                "sets\n";
+        PIN_ExitApplication(1);
+    }
+    level->sets = (UINT32)sets;
+    level->ways = ways;
+    level->block_bits = block_bits;
+    level->tags.assign(blocks, 0);
+    level->stamps.assign(blocks, 0);
+    level->clock = 0;
+}
+
+// Access the block containing 'addr', returning whether it was a hit
+static bool cache_access(CacheLevel *level, ADDRINT addr) {
+    UINT64 tag = (addr >> level->block_bits) + 1;
+    UINT64 first = (tag & (level->sets - 1)) * level->ways;
+    UINT64 victim = first;
+    ++level->clock;
+    for (UINT64 i = first; i < first + level->ways; ++i) {
+        if (level->tags[i] == tag) {
+            level->stamps[i] = level->clock;
+            return true;
+        }
+        if (level->stamps[i] < level->stamps[victim])
+            victim = i;
+    }
+    level->tags[victim] = tag;
+    level->stamps[victim] = level->clock;
+    return false;
+}
+
+// Simulate an access to [addr, addr + size) in 'layout', one line at a time
+static VOID simulate(UINT32 layout, CacheStats *s, ADDRINT addr, INT32 size) {
+    CacheLevel *l = levels[layout];
+    ADDRINT last = (addr + size - 1) >> CACHE_LINE_BITS;
+    for (ADDRINT line = addr >> CACHE_LINE_BITS; line <= last; ++line) {
+        ADDRINT line_addr = line << CACHE_LINE_BITS;
+        if (!cache_access(&l[0], line_addr)) {
+            ++s->misses[layout][0];
+            if (!cache_access(&l[1], line_addr))
+                ++s->misses[layout][1];
+        }
+        if (!cache_access(&l[2], line_addr))
+            ++s->misses[layout][2];
+    }
+}
+
+static VOID parse_groups(const string &filename) {
+    ifstream file(filename.c_str());
+    if (!file) {
+        cerr << "ERROR: Failed to open groups file " << filename << "\n";
+        PIN_ExitApplication(1);
+    }
+    string line;
+    INT32 group = -1;
+    while (getline(file, line)) {
+        UINT32 id;
+        if (sscanf(line.c_str(), "GRP %u", &id) == 1) {
+            group = (INT32)id;
+            if (id >= groups.size())
+                groups.resize(id + 1, HaloGroup());
+        } else if (sscanf(line.c_str(), " CTX %u", &id) == 1 && group >= 0) {
+            if (id >= context_groups.size())
+                context_groups.resize(id + 1, -1);
+            context_groups[id] = group;
+        }
+    }
+}
+
+static inline INT32 group_of(AllocationContextId context) {
+    return context < context_groups.size() ? context_groups[context] : -1;
+}
+
+static inline UINT64 chunk_index(ADDRINT addr) {
+    return (addr - HALO_SLAB_BASE) / chunk_size;
+}
+
+static ADDRINT allocate_chunk(INT32 group) {
+    ADDRINT chunk;
+    if (!spare_chunks.empty()) {
+        chunk = spare_chunks.back();
+        spare_chunks.pop_back();
+    } else {
+        chunk = slab_ptr;
+        slab_ptr += chunk_size;
+        chunk_live.push_back(0);
+        chunk_group.push_back(0);
+    }
+    chunk_group[chunk_index(chunk)] = group;
+    return chunk + HALO_CHUNK_HEADER_SIZE;
+}
+
+// Emulate group_aligned_alloc() with the default alignment
+static ADDRINT group_alloc(INT32 group, INT32 req_size) {
+    UINT64 size = std::max(req_size, 1);
+    ADDRINT curr = groups[group].curr;
+    ADDRINT offset = (HALO_ALIGNMENT - curr % HALO_ALIGNMENT) % HALO_ALIGNMENT;
+    if (!curr || ((curr + offset + size) & ~(chunk_size - 1)) > curr) {
+        curr = allocate_chunk(group);
+        offset = (HALO_ALIGNMENT - curr % HALO_ALIGNMENT) % HALO_ALIGNMENT;
+    }
+    ++chunk_live[chunk_index(curr)];
+    groups[group].curr = curr + offset + size;
+    return curr + offset;
+}
+
+// Emulate group_free(): empty chunks are reset if in use, otherwise kept for
+// reuse (up to a limit, unless it is zero) or abandoned, as libhalo never
+// reuses their addresses
+static VOID group_free(ADDRINT addr) {
+    UINT64 index = chunk_index(addr);
+    if (--chunk_live[index])
+        return;
+    ADDRINT chunk = HALO_SLAB_BASE + index * chunk_size;
+    INT32 group = chunk_group[index];
+    if ((groups[group].curr & ~(chunk_size - 1)) == chunk)
+        groups[group].curr = chunk + HALO_CHUNK_HEADER_SIZE;
+    else if (spare_chunks.size() < max_spare_chunks || !max_spare_chunks)
+        spare_chunks.push_back(chunk);
+}
+
+static VOID write_misses(ostream &out, const UINT64 *misses) {
+    out << "{";
+    for (UINT32 i = 0; i < CACHE_SIM_LEVELS; ++i) {
+        out << (i ? ", " : "") << "\"" << level_names[i] << "_misses\": "
+            << misses[i];
+    }
+    out << "}";
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+// 'geometry' gives the size in bytes and associativity of the L1 and L2
+// caches and the number of entries and associativity of the TLB, as
+// 'l1_size:ways,l2_size:ways,tlb_entries:ways'. Grouped objects are placed
+// as by a libhalo built with the given CHUNK_SIZE and MAX_SPARE_CHUNKS.
+static VOID configure(const string &geometry, const string &groups_file,
+                      UINT64 halo_chunk_size, UINT64 spare_chunks_limit)
+{
+    UINT32 l1_size, l1_ways, l2_size, l2_ways, tlb_entries, tlb_ways;
+    if (sscanf(geometry.c_str(), "%u:%u,%u:%u,%u:%u", &l1_size, &l1_ways,
+               &l2_size, &l2_ways, &tlb_entries, &tlb_ways) != 6)
+    {
+        cerr << "ERROR: cache geometry must be given as "
+                "'l1_size:ways,l2_size:ways,tlb_entries:ways'\n";
+        PIN_ExitApplication(1);
+    }
+    if (halo_chunk_size & (halo_chunk_size - 1) ||
+        halo_chunk_size <= HALO_CHUNK_HEADER_SIZE +
+        (UINT64)DynAllocTracer::max_object_size)
+    {
+        cerr << "ERROR: libhalo chunk size must be a power of two larger "
+                "than the maximum object size\n";
+        PIN_ExitApplication(1);
+    }
+    for (UINT32 i = 0; i < CACHE_SIM_LAYOUTS; ++i) {
+        cache_level_init(&levels[i][0], l1_size >> CACHE_LINE_BITS, l1_ways,
+                         CACHE_LINE_BITS);
+        cache_level_init(&levels[i][1], l2_size >> CACHE_LINE_BITS, l2_ways,
+                         CACHE_LINE_BITS);
+        cache_level_init(&levels[i][2], tlb_entries, tlb_ways, PAGE_BITS);
+    }
+    chunk_size = halo_chunk_size;
+    max_spare_chunks = spare_chunks_limit;
+    if (!groups_file.empty()) {
+        parse_groups(groups_file);
+        grouped = true;
+    }
+    enabled = true;
+}
+
+static VOID object_allocated(ObjectSlot slot, AllocationRecord *record) {
+    if (!enabled)
+        return;
+    if (record->context >= stats.size())
+        stats.resize(record->context + 1, CacheStats());
+    if (!grouped)
+        return;
+    if (slot >= remapped.size())
+        remapped.resize(slot + 1, 0);
+    INT32 group = group_of(record->context);
+    remapped[slot] = group < 0 ? 0 : group_alloc(group, record->size);
+}
+
+static VOID object_freed(ObjectSlot slot, AllocationRecord *) {
+    if (!grouped || !remapped[slot])
+        return;
+    group_free(remapped[slot]);
+    remapped[slot] = 0;
+}
+
+// Simulate an access to 'addr' within 'obj' (in 'slot') in every layout
+static inline VOID object_accessed(ObjectSlot slot, AllocationRecord *obj,
+                                   ADDRINT addr, INT32 size)
+{
+    if (!enabled)
+        return;
+    CacheStats *s = &stats[obj->context];
+    ++s->accesses;
+    simulate(LAYOUT_BASELINE, s, addr, size);
+    if (!grouped)
+        return;
+    if (group_of(obj->context) >= 0)
+        addr = remapped[slot] + (addr - obj->addr);
+    simulate(LAYOUT_GROUPED, s, addr, size);
+}
+
+// Write the misses of each context that made a heap access, and in total,
+// along with the fraction of misses grouping would remove
+static VOID write(const string &filename) {
+    CacheStats total = CacheStats();
+    UINT32 layouts = grouped ? CACHE_SIM_LAYOUTS : 1;
+    ofstream report;
+    report.open(filename.c_str());
+    report << "{\n  \"contexts\": [";
+    const char *separator = "\n";
+    for (AllocationContextId i = 0; i < stats.size(); ++i) {
+        CacheStats *s = &stats[i];
+        if (!s->accesses)
+            continue;
+        report << separator << "    {\"id\": " << i;
+        if (grouped)
+            report << ", \"group\": " << group_of(i);
+        report << ", \"accesses\": " << s->accesses;
+        total.accesses += s->accesses;
+        for (UINT32 j = 0; j < layouts; ++j) {
+            report << ", \"" << layout_names[j] << "\": ";
+            write_misses(report, s->misses[j]);
+            for (UINT32 k = 0; k < CACHE_SIM_LEVELS; ++k)
+                total.misses[j][k] += s->misses[j][k];
+        }
+        report << "}";
+        separator = ",\n";
+    }
+    report << "\n  ],\n  \"accesses\": " << total.accesses;
+    for (UINT32 j = 0; j < layouts; ++j) {
+        report << ",\n  \"" << layout_names[j] << "\": ";
+        write_misses(report, total.misses[j]);
+    }
+    cerr << "Simulated " << total.accesses << " heap accesses" << endl;
+    if (grouped) {
+        report << ",\n  \"reduction\": {";
+        for (UINT32 k = 0; k < CACHE_SIM_LEVELS; ++k) {
+            UINT64 before = total.misses[LAYOUT_BASELINE][k];
+            UINT64 after = total.misses[LAYOUT_GROUPED][k];
+            double reduction = before ? 1.0 - (double)after / before : 0.0;
+            report << (k ? ", " : "") << "\"" << level_names[k] << "\": "
+                   << reduction;
+            cerr << "  " << level_names[k] << " misses: " << before << " -> "
+                 << after << endl;
+        }
+        report << "}";
+    }
+    report << "\n}\n";
+    report.close();
+}
+}
@@ -0,0 +1,161 @@
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+#define REPORT_SIZE_BUCKETS     32
+#define REPORT_LIFETIME_BUCKETS 64
+#define CACHE_LINE_BITS         6
+
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+// Heap statistics of one allocation context. Histograms are bucketed by
+// floor(log2(value)), with zero counted in the first bucket.
+struct ContextStats {
+    UINT64 allocations;
+    UINT64 frees;
+    UINT64 bytes_allocated;
+    UINT64 live_objects, live_bytes;
+    UINT64 peak_live_objects, peak_live_bytes;
+    UINT64 accesses;
+    UINT64 first_line_accesses;
+    UINT64 sizes[REPORT_SIZE_BUCKETS];
+    UINT64 lifetimes[REPORT_LIFETIME_BUCKETS];
+};
+
+// Per-context statistics on allocation sizes, lifetimes (in instructions
+// executed by the allocating and freeing threads), peak live data and access
+// density, written out as JSON. Kept in step with the object table, under the
+// same locking.
+namespace ContextReport {
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static bool enabled = false;
+static vector<ContextStats> stats;
+
+// The instruction count at which the object in each slot was allocated
+static vector<UINT64> alloc_times;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static inline UINT32 bucket(UINT64 value) {
+    return value ? 63 - __builtin_clzll(value) : 0;
+}
+
+static VOID write_histogram(ostream &out, const char *name,
+                            const UINT64 *counts, UINT32 buckets)
+{
+    out << "\"" << name << "\": [";
+    const char *separator = "";
+    for (UINT32 i = 0; i < buckets; ++i) {
+        if (!counts[i])
+            continue;
+        out << separator << "{\"min\": " << (i ? 1ULL << i : 0)
+            << ", \"count\": " << counts[i] << "}";
+        separator = ", ";
+    }
+    out << "]";
+}
+
+static double ratio(UINT64 a, UINT64 b) {
+    return b ? (double)a / b : 0.0;
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+static VOID object_allocated(ObjectSlot slot, AllocationRecord *record,
+                             UINT64 time)
+{
+    if (!enabled)
+        return;
+    if (slot >= alloc_times.size())
+        alloc_times.resize(slot + 1);
+    alloc_times[slot] = time;
+    if (record->context >= stats.size())
+        stats.resize(record->context + 1, ContextStats());
+
+    ContextStats *s = &stats[record->context];
+    UINT64 size = record->size;
+    ++s->allocations;
+    s->bytes_allocated += size;
+    ++s->sizes[bucket(size)];
+    s->peak_live_objects = std::max(s->peak_live_objects, ++s->live_objects);
+    s->peak_live_bytes = std::max(s->peak_live_bytes, s->live_bytes += size);
+}
+
+// Lifetimes are measured in the instruction counts of the allocating and
+// freeing threads, so objects freed by a different thread to the one that
+// allocated them may appear to have been freed before they were allocated, in
+// which case their lifetime is counted as zero
+static VOID object_freed(ObjectSlot slot, AllocationRecord *record,
+                         UINT64 time)
+{
+    if (!enabled)
+        return;
+    ContextStats *s = &stats[record->context];
+    UINT64 lifetime = time > alloc_times[slot] ? time - alloc_times[slot] : 0;
+    ++s->frees;
+    --s->live_objects;
+    s->live_bytes -= record->size;
+    ++s->lifetimes[bucket(lifetime)];
+}
+
+// Count an access to 'addr' within 'obj' (may be called concurrently)
+static inline VOID object_accessed(AllocationRecord *obj, ADDRINT addr) {
+    if (!enabled)
+        return;
+    ContextStats *s = &stats[obj->context];
+    __sync_fetch_and_add(&s->accesses, 1);
+    if ((addr >> CACHE_LINE_BITS) == (obj->addr >> CACHE_LINE_BITS))
+        __sync_fetch_and_add(&s->first_line_accesses, 1);
+}
+
+// Write the report for every context that allocated an object. Access counts
+// are scaled up by 'access_scale' to account for sampling.
+static VOID write(const string &filename, UINT64 instr_count,
+                  double access_scale)
+{
+    ofstream report;
+    report.open(filename.c_str());
+    report << "{\n  \"instructions\": " << instr_count
+           << ",\n  \"access_scale\": " << access_scale
+           << ",\n  \"contexts\": [";
+    const char *separator = "\n";
+    for (AllocationContextId i = 0; i < stats.size(); ++i) {
+        ContextStats *s = &stats[i];
+        Context *c = &DynAllocTracer::contexts[i];
+        if (!s->allocations)
+            continue;
+        report << separator << "    {\"id\": " << i
+               << ", \"popular\": " << (c->mark ? "true" : "false")
+               << ", \"allocations\": " << s->allocations
+               << ", \"frees\": " << s->frees
+               << ", \"bytes_allocated\": " << s->bytes_allocated
+               << ", \"peak_live_objects\": " << s->peak_live_objects
+               << ", \"peak_live_bytes\": " << s->peak_live_bytes
+               << ", \"unique_accesses\": " << c->access_count
+               << ", \"accesses\": " << s->accesses
+               << ", \"accesses_per_object\": "
+               << ratio(s->accesses, s->allocations) * access_scale
+               << ", \"accesses_per_byte\": "
+               << ratio(s->accesses, s->bytes_allocated) * access_scale
+               << ", \"first_line_fraction\": "
+               << ratio(s->first_line_accesses, s->accesses) << ",\n     ";
+        write_histogram(report, "sizes", s->sizes, REPORT_SIZE_BUCKETS);
+        report << ",\n     ";
+        write_histogram(report, "lifetimes", s->lifetimes,
+                        REPORT_LIFETIME_BUCKETS);
+        report << "}";
+        separator = ",\n";
+    }
+    report << "\n  ]\n}\n";
+    report.close();
+}
+}
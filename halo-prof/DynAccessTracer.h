@@ -5,199 +5,250 @@ namespace DynAccessTracer {
 
 KNOB<INT32> KnobAffinityDistance(KNOB_MODE_WRITEONCE, "pintool",
     "affinity-distance", "1024", "maximum affinity distance in bytes");
-
-/* ===================================================================== */
-// Constants
-/* ===================================================================== */
-
-#define AFFINITY_DISTANCE (KnobAffinityDistance.Value())
-#define MIN_ACCESS_SIZE      4
-#define AFFINITY_QUEUE_MAX_LEN (AFFINITY_DISTANCE / MIN_ACCESS_SIZE)
+KNOB<string> KnobAffinityDistances(KNOB_MODE_WRITEONCE, "pintool",
+    "affinity-distances", "", "comma-separated list of smaller affinity "
+    "distances to also write locality graphs for");
+KNOB<string> KnobAffinityModel(KNOB_MODE_WRITEONCE, "pintool",
+    "affinity-model", "bytes", "what the affinity distance measures: 'bytes' "
+    "of distinct heap object accesses, bytes of 'all-accesses' (including "
+    "repeated, stack and global ones), distinct cache 'lines' (LRU reuse "
+    "distance), or 'decay' (edges weighted down by instruction distance)");
+KNOB<UINT64> KnobAffinityHalfLife(KNOB_MODE_WRITEONCE, "pintool",
+    "affinity-half-life", "1000", "number of instructions over which edge "
+    "weights halve in the decay model");
+KNOB<UINT64> KnobMaxEdges(KNOB_MODE_WRITEONCE, "pintool", "max-edges", "0",
+    "keep at most this many affinity edges per graph, folding the lightest "
+    "into a count-min sketch (0 keeps every edge)");
+KNOB<BOOL> KnobCrossThreadAffinity(KNOB_MODE_WRITEONCE, "pintool",
+    "cross-thread-affinity", "0", "count affinity between accesses made by "
+    "different threads");
+KNOB<UINT32> KnobSampleObjects(KNOB_MODE_WRITEONCE, "pintool",
+    "sample-objects", "1", "only count affinity between objects in a "
+    "sampled subset of one in this many");
+KNOB<UINT64> KnobIntervalLength(KNOB_MODE_WRITEONCE, "pintool",
+    "interval-length", "0", "also write the heap accesses and affinity edges "
+    "of each interval of this many instructions per thread (0 writes none)");
+KNOB<string> KnobIntervalOutput(KNOB_MODE_WRITEONCE, "pintool",
+    "interval-output", "intervals.txt", "specify interval output filename");
+KNOB<BOOL> KnobAllocOnly(KNOB_MODE_WRITEONCE, "pintool", "alloc-only", "0",
+    "only trace allocations, leaving heap accesses uninstrumented (to pick "
+    "candidate contexts from the context report cheaply)");
 
 /* ================================================================== */
 // Global variables
 /* ================================================================== */
 
-static UINT64 access_count = 0;
-static ObjectId last_touched_object = 0;
-static ADDRINT last_write_addr;
-static INT32 last_write_size;
-struct AccessRecord {
-    ObjectRecord record;
-    INT32 size;
-};
-static struct {
-    UINT64 head;
-    AccessRecord *data;
-} affinity_queue;
-static std::map<ObjectId, std::map<ObjectId, UINT32>> affinity_graph;
+// Every live per-thread state (AffinityGraph.h) is guarded by the object table
+// locks (DynAllocTracer::lock_table), a thread's own state only needing its own
+// reader lock. 'shared_lock' also guards the shared state, the
+// cache simulator (CacheSim.h), the field profile (FieldProfile.h) and the
+// page graph (PageGraph.h)
+static PIN_LOCK shared_lock;
+static TLS_KEY tls_key;
 
 /* ================================================================== */
 // Helper functions
 /* ================================================================== */
 
-static bool is_coallocatable(AddrMapItr a, AddrMapItr b) {
-    // Objects cannot be co-allocated with themselves
-    if (a->second.id == b->second.id)
-        return false;
-
-    // Ensure that 'a' and 'b' are in allocation order
-    if (b->second.id < a->second.id) {
-        AddrMapItr tmp = a;
-        a = b;
-        b = tmp;
-    }
-
-    // Check co-allocatability
-    // TODO: Make sure this works as expected around realloc
-    ObjectId a_succ = a->second.successor;
-    ObjectId b_pred = b->second.predecessor;
-    return (!a_succ || a_succ >= b->second.id) &&
-           (!b_pred || b_pred <= a->second.id);
-
+static inline AffinityState *thread_state(THREADID tid) {
+    return static_cast<AffinityState *>(PIN_GetThreadData(tls_key, tid));
 }
 
-static VOID process_affinity(AddrMapItr a, ObjectRecord obj) {
-    AddrMapItr b = DynAllocTracer::get_allocation_itr(obj);
-    if (b == DynAllocTracer::allocations.end())
+// Process a batch of heap events buffered by thread 'tid'
+static VOID process_trace(THREADID tid, const TraceRecord *records,
+                          UINT64 count)
+{
+    if (!ShadowStack::entered_main)
         return;
+    DynAllocTracer::lock_table(tid);
+    process_records(thread_state(tid), records, count);
+    DynAllocTracer::unlock_table();
+}
 
-    // Don't count relationships between an object and itself
-    if (a->second.id == b->second.id)
-        return;
+/* ===================================================================== */
+// Analysis functions
+/* ===================================================================== */
 
-    // Don't double count relationships with the same object
-    if (b->second.mark == access_count)
+// Move the thread on to its next interval, after any accesses it has buffered
+static VOID clock_tick(THREADID tid, UINT64 time) {
+    if (TraceBuffer::enabled) {
+        TraceBuffer::append_clock(tid, time);
         return;
-    b->second.mark = access_count;
-
-    // Process
-    if (is_coallocatable(a, b)) {
-        ObjectId tmp;
-        ObjectId a_ctx = a->second.context;
-        ObjectId b_ctx = b->second.context;
-        if (b_ctx > a_ctx) { tmp = a_ctx; a_ctx = b_ctx; b_ctx = tmp; }
-        affinity_graph[a_ctx][b_ctx]++;
     }
+    DynAllocTracer::lock_table(tid);
+    advance_clock(thread_state(tid), time);
+    DynAllocTracer::unlock_table();
 }
 
-static UINT64 affinity_queue_mask_ix(UINT64 ix) {
-    return ix & (AFFINITY_QUEUE_MAX_LEN - 1);
-}
+// NOTE: Right now we're assuming programs only touch one object per access
+VOID PIN_FAST_ANALYSIS_CALL trace_access(THREADID tid, CHAR type, ADDRINT ip,
+                                         ADDRINT addr, INT32 size,
+                                         BOOL prefetch)
+{
+    if (!ShadowStack::entered_main)
+        return;
 
-static VOID affinity_queue_add_access(AddrMapItr src, INT32 size) {
-    ObjectRecord obj = { src->second.id, src->first };
-    UINT64 ix = affinity_queue_mask_ix(affinity_queue.head++);
-    affinity_queue.data[ix].record = obj;
-    affinity_queue.data[ix].size = size;
-
-    INT32 total_size = 0;
-    for (UINT64 i = ix - 1; i != ix && total_size < AFFINITY_DISTANCE; --i) {
-        AccessRecord prev_access;
-        i = affinity_queue_mask_ix(i);
-        prev_access = affinity_queue.data[i];
-        if (!prev_access.record.addr)
-            break;
-        process_affinity(src, prev_access.record);
-        total_size += prev_access.size;
+    // Otherwise, profile this access (or just age the window by it). In the
+    // all-accesses model, accesses outside the heap range get here too.
+    AffinityState *state = thread_state(tid);
+    ThreadAllocs *reader = DynAllocTracer::thread_state(tid);
+    UINT64 time = 0;
+    if (affinity_model == AFFINITY_DECAY)
+        time = reader->instr_count;
+    PIN_GetLock(&reader->lock, tid + 1);
+    ObjectSlot slot = 0;
+    if (DynAllocTracer::in_heap_range(addr))
+        slot = DynAllocTracer::allocation_slot(addr);
+    AllocationRecord *obj = slot ? DynAllocTracer::object_at(slot) : NULL;
+    if (obj || affinity_model == AFFINITY_ALL_ACCESSES) {
+        bool skip = !obj || type == TRACE_SKIP;
+        bool exclusive = shared || ((CacheSim::enabled ||
+                                     FieldProfile::enabled ||
+                                     PageGraph::enabled) && !skip);
+        if (exclusive)
+            PIN_GetLock(&shared_lock, tid + 1);
+        if (skip)
+            affinity_window_skip(&state->window, addr, size, time);
+        else
+            profile_access(state, slot, obj, addr, size, time);
+        if (exclusive)
+            PIN_ReleaseLock(&shared_lock);
+    } else if (type != TRACE_SKIP) {
+        __sync_fetch_and_add(&unknown_accesses, 1);
     }
+    PIN_ReleaseLock(&reader->lock);
 }
 
 /* ===================================================================== */
-// Analysis functions
+// Instrumentation functions
 /* ===================================================================== */
 
-// NOTE: Right now we're assuming programs only touch one object per access
-VOID PIN_FAST_ANALYSIS_CALL trace_access(CHAR type, ADDRINT ip, ADDRINT addr,
-                                         INT32 size, BOOL prefetch)
+// Profile a memory operand. The inlined range check keeps accesses that
+// cannot hit a tracked object (globals, mmap'd buffers, large objects) from
+// ever reaching the analysis routine, except in the all-accesses model, where
+// every access ages the window. Only the effective address is needed, so
+// stores are handled before they execute just like loads.
+static VOID instrument_access(INS ins, IARG_TYPE ea, IARG_TYPE size,
+                              UINT32 type)
 {
-    AddrMapItr it = DynAllocTracer::get_allocation_itr(addr);
-    // TODO: It might be worth redefining the affinity distance parameter such
-    // that *all* accesses, including non-heap accesses, count against it
-    if (!ShadowStack::entered_main || it == DynAllocTracer::allocations.end())
-        return;
-
-    // Otherwise, profile this access
-    // TODO: It might be worth redefining the affinity distance parameter such
-    // that repeated accesses like this count against it regardless
-    if (it->second.id != last_touched_object) {
-        ++access_count;
-        ++DynAllocTracer::contexts[it->second.context].access_count;
-        affinity_queue_add_access(it, size);
-        last_touched_object = it->second.id;
+    VOID (*insert_call)(INS, IPOINT, AFUNPTR, ...) = INS_InsertPredicatedCall;
+    if (affinity_model != AFFINITY_ALL_ACCESSES) {
+        INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE,
+                                   (AFUNPTR)DynAllocTracer::in_heap_range,
+                                   IARG_FAST_ANALYSIS_CALL, ea, IARG_END);
+        insert_call = INS_InsertThenPredicatedCall;
+    }
+    if (TraceBuffer::enabled) {
+        insert_call(ins, IPOINT_BEFORE, (AFUNPTR)TraceBuffer::append_access,
+                    IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, ea, size,
+                    IARG_UINT32, type, IARG_END);
+    } else {
+        insert_call(ins, IPOINT_BEFORE, (AFUNPTR)trace_access,
+                    IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_UINT32, type,
+                    IARG_INST_PTR, ea, size, IARG_BOOL, INS_IsPrefetch(ins),
+                    IARG_END);
     }
 }
 
-VOID PIN_FAST_ANALYSIS_CALL trace_pre_write(ADDRINT addr, INT32 size) {
-    last_write_addr = addr;
-    last_write_size = size;
-}
-
-VOID PIN_FAST_ANALYSIS_CALL trace_write(ADDRINT ip) {
-    trace_access('W', ip, last_write_addr, last_write_size, false);
-}
+static VOID instrument_instruction(INS ins)
+{
+    // Accesses made by code that isn't profiled are either dropped here or
+    // traced as filler
+    UINT32 read = TRACE_READ;
+    UINT32 write = TRACE_WRITE;
+    if (!AccessFilter::is_profiled(ins)) {
+        if (!AccessFilter::filler)
+            return;
+        read = write = TRACE_SKIP;
+    }
 
-/* ===================================================================== */
-// Instrumentation functions
-/* ===================================================================== */
+    // Stack and global accesses can't hit the heap, but still age the window
+    // in the all-accesses model
+    bool all = affinity_model == AFFINITY_ALL_ACCESSES;
 
-static VOID instrument_instruction(INS ins, VOID *v)
-{
     // Instrument loads (iff the load will be actually executed)
     if (INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins) &&
-        !INS_IsStackRead(ins) && !INS_IsIpRelRead(ins))
+        (all || (!INS_IsStackRead(ins) && !INS_IsIpRelRead(ins))))
     {
-        INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)trace_access,
-                                 IARG_FAST_ANALYSIS_CALL, IARG_UINT32, 'R',
-                                 IARG_INST_PTR, IARG_MEMORYREAD_EA,
-                                 IARG_MEMORYREAD_SIZE, IARG_BOOL,
-                                 INS_IsPrefetch(ins), IARG_END);
+        instrument_access(ins, IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE,
+                          read);
     }
-
-    if (INS_HasMemoryRead2(ins) && INS_IsStandardMemop(ins))
-    {
-        INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)trace_access,
-                                 IARG_FAST_ANALYSIS_CALL, IARG_UINT32, 'R',
-                                 IARG_INST_PTR, IARG_MEMORYREAD2_EA,
-                                 IARG_MEMORYREAD_SIZE, IARG_BOOL,
-                                 INS_IsPrefetch(ins), IARG_END);
+    if (INS_HasMemoryRead2(ins) && INS_IsStandardMemop(ins)) {
+        instrument_access(ins, IARG_MEMORYREAD2_EA, IARG_MEMORYREAD_SIZE,
+                          read);
     }
 
     // Instrument stores (iff the store will be actually executed)
     if (INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins) &&
-        !INS_IsStackWrite(ins) && !INS_IsIpRelWrite(ins))
+        (all || (!INS_IsStackWrite(ins) && !INS_IsIpRelWrite(ins))))
     {
-        INS_InsertPredicatedCall(ins, IPOINT_BEFORE,
-                                 (AFUNPTR)trace_pre_write,
-                                 IARG_FAST_ANALYSIS_CALL, IARG_MEMORYWRITE_EA,
-                                 IARG_MEMORYWRITE_SIZE, IARG_END);
-
-        if (INS_HasFallThrough(ins))
-        {
-            INS_InsertCall(ins, IPOINT_AFTER, (AFUNPTR)trace_write,
-                           IARG_FAST_ANALYSIS_CALL, IARG_INST_PTR, IARG_END);
-        }
-        if (INS_IsBranchOrCall(ins))
-        {
-            INS_InsertCall(ins, IPOINT_TAKEN_BRANCH, (AFUNPTR)trace_write,
-                           IARG_FAST_ANALYSIS_CALL, IARG_INST_PTR, IARG_END);
-        }
+        instrument_access(ins, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE,
+                          write);
     }
 }
 
-static void initialize(void) {
-    if ((AFFINITY_DISTANCE & (AFFINITY_DISTANCE - 1)) != 0) {
-        cerr << "ERROR: affinity distance must be a power of two\n";
-        PIN_ExitApplication(1);
-    }
+// Heap accesses are left uninstrumented in versions of the trace used while
+// sampling is switched off
+static VOID instrument_trace(TRACE trace, VOID *v) {
+    if (!TraceControl::is_traced(trace))
+        return;
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+            instrument_instruction(ins);
+}
 
-    affinity_queue.data = (AccessRecord *)calloc(AFFINITY_QUEUE_MAX_LEN,
-                                                 sizeof(AccessRecord));
-    if (!affinity_queue.data) {
-        cerr << "ERROR: Failed to allocate affinity queue\n";
-        PIN_ExitApplication(1);
-    }
+static VOID thread_start(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
+    DynAllocTracer::lock_table(tid);
+    AffinityState *state = new_state();
+    DynAllocTracer::unlock_table();
+    PIN_SetThreadData(tls_key, state, tid);
+}
 
-    INS_AddInstrumentFunction(instrument_instruction, 0);
+// Fold the thread's results into the merged graph
+static VOID thread_fini(THREADID tid, const CONTEXT *ctxt, INT32 code,
+                        VOID *v)
+{
+    AffinityState *state = thread_state(tid);
+    PIN_SetThreadData(tls_key, NULL, tid);
+    if (TraceWriter::enabled)
+        TraceWriter::thread_end(tid);
+    DynAllocTracer::lock_table(tid);
+    retire_state(state);
+    DynAllocTracer::unlock_table();
+}
+
+static void initialize(void) {
+    // Recordings only need the clock ticks, and are split into intervals
+    // when they're replayed
+    configure(KnobAffinityDistance.Value(), KnobAffinityDistances.Value(),
+              KnobCrossThreadAffinity.Value(), KnobSampleObjects.Value(),
+              TraceWriter::enabled ? 0 : KnobIntervalLength.Value(),
+              KnobIntervalOutput.Value(), KnobAffinityModel.Value(),
+              KnobAffinityHalfLife.Value(), KnobMaxEdges.Value());
+    DynAllocTracer::clock_interval = KnobIntervalLength.Value();
+
+    // Buffered and recorded accesses need extra clock ticks for the decay
+    // model
+    if (affinity_model == AFFINITY_DECAY &&
+        (TraceWriter::enabled || TraceBuffer::KnobTraceBufferSize.Value()))
+    {
+        UINT64 tick = std::max(half_life / DECAY_TICKS_PER_HALF_LIFE,
+                               (UINT64)1);
+        UINT64 &interval = DynAllocTracer::clock_interval;
+        interval = interval ? std::min(interval, tick) : tick;
+    }
+    tls_key = PIN_CreateThreadDataKey(NULL);
+    PIN_InitLock(&shared_lock);
+
+    // NOTE: Buffered events must be processed (or recorded) before per-thread
+    // state is merged, so the trace buffer's thread fini function is
+    // registered first. Recording always goes through the trace buffer.
+    if (TraceWriter::enabled)
+        TraceBuffer::initialize(TraceWriter::write_records, true);
+    else
+        TraceBuffer::initialize(process_trace, false);
+    Attach::add_thread_functions(thread_start, thread_fini);
+    if (!KnobAllocOnly.Value())
+        TRACE_AddInstrumentFunction(instrument_trace, 0);
 }
 }
@@ -2,41 +2,44 @@
 // Structures and types
 /* ================================================================== */
 
-typedef UINT32 ObjectId;
-typedef UINT32 AllocationContextId;
-struct ObjectRecord {
-    ObjectId id;
-    ADDRINT addr;
+// Per-thread state of in-progress allocation calls. Only the outermost of
+// any nested allocator calls (e.g. 'operator new' calling 'malloc') is traced,
+// and 'allocator_sp' is the stack pointer it was entered with. 'lock' is the
+// thread's share of 'table_lock' (see lock_table).
+struct ThreadAllocs {
+    PIN_LOCK lock;
+    VOID *last_allocation_dest;
+    ADDRINT last_allocation_ptr;
+    INT32 last_allocation_size;
+    UINT32 allocator_depth;
+    ADDRINT allocator_sp;
+    UINT64 instr_count;
+    UINT64 counted_instrs;
+    UINT64 next_clock;
 };
-struct AllocationRecord {
-    INT32 size;
-    ObjectId id;
-    ObjectId predecessor, successor;
-    AllocationContextId context;
-    UINT32 mark;
-};
-struct Context {
-    ObjectRecord last_object;
-    UINT32 access_count;
-    UINT32 mark;
-};
-typedef pair<ShadowStack::Chain, AllocationContextId> ChainPair;
-typedef unordered_map<ShadowStack::Chain, AllocationContextId> ChainMap;
-typedef ChainMap::iterator ChainMapItr;
-typedef unordered_map<AllocationContextId, Context> ContextMap;
-typedef ContextMap::iterator ContextMapItr;
-typedef map< ADDRINT, AllocationRecord, greater<ADDRINT> > AddrMap;
-typedef AddrMap::iterator AddrMapItr;
 
 /* ===================================================================== */
 // Constants
 /* ===================================================================== */
 
-#define MAX_ALLOC_CALL_SITES 65536ULL
+// Cached in place of a context id for call chains whose objects aren't tracked
+#define UNTRACKED_CONTEXT (NO_ALLOCATION_CONTEXT - 1)
+
+// Tracked objects are covered by up to HEAP_RANGES address ranges, so that
+// the gaps between the main heap, thread arenas and mmap'd chunks aren't
+// instrumented. An allocation further than HEAP_RANGE_GAP bytes from every
+// range starts a new one while there are ranges to spare. in_heap_range
+// checks each range explicitly.
+#define HEAP_RANGES 4
+#define HEAP_RANGE_GAP (16ULL << 20)
+
+// Threads add their instruction counts to the total in batches of this many
+#define INSTR_COUNT_BATCH 65536
 
-static const char *alloc_funcs[] = { MALLOC, CALLOC, POSIX_MEMALIGN,
-                                     ALIGNED_ALLOC, REALLOC, FREE };
-static int alloc_funcs_nparams[] = { 1, 2, 3, 2, 2, 1 };
+// Let the affinity model know how far each thread has got (DynAccessTracer.h)
+namespace DynAccessTracer {
+static VOID clock_tick(THREADID tid, UINT64 time);
+}
 
 namespace DynAllocTracer {
 /* ===================================================================== */
@@ -47,192 +50,353 @@ KNOB<string> KnobContextTraceOutput(KNOB_MODE_WRITEONCE, "pintool",
     "contexts-output", "contexts.txt", "specify contexts output filename");
 
 KNOB<string> KnobInstructionLimit(KNOB_MODE_WRITEONCE, "pintool",
-    "instruction-limit", "0", "specify dynamic instruction count limit");
+    "instruction-limit", "0", "specify dynamic instruction count limit "
+    "(across all threads)");
+
+KNOB<string> KnobCandidateContexts(KNOB_MODE_WRITEONCE, "pintool",
+    "candidate-contexts", "", "only track objects from the allocation "
+    "contexts listed in this file (in the format of the contexts output)");
 
 /* ================================================================== */
 // Global variables
 /* ================================================================== */
 
-static AddrMap allocations;
-static ContextMap contexts;
-static ChainMap chains;
+// The object table, shadow memory and context table (ObjectTable.h) are shared
+// by all threads. Heap accesses only read them, and vastly outnumber the
+// updates, so each thread reads under a lock of its own ('ThreadAllocs::lock')
+// that no other reader touches. Updates take 'table_lock' and then the lock of
+// every thread in 'readers', which only changes under 'table_lock'.
+static PIN_LOCK table_lock;
+static vector<ThreadAllocs *> readers;
+
+// Contexts are created on whichever thread allocates first
+static vector<ShadowStack::ContextNode *> context_nodes;
+static PIN_LOCK context_lock;
+
+// The printed call chains of the candidate contexts, if only those are tracked
+static set<string> candidates;
+
 static UINT64 instr_count = 0;
 static UINT64 instr_limit = 0;
-static ObjectId next_object_id = 1;
-static AllocationContextId next_context_id = 0;
-static VOID *last_allocation_dest;
-static INT32 last_allocation_size;
-static ofstream ContextTrace;
+
+// Threads tick once every 'clock_interval' instructions (0 never ticks)
+static UINT64 clock_interval = 0;
+static TLS_KEY tls_key;
+
+// Every address that may hold a tracked object lies within one of the ranges
+// [heap_base[i], heap_base[i] + heap_span[i]), where unused ranges are empty.
+// Only updated on application threads (under 'range_lock'), and read without
+// locking by inlined analysis code, as missing an access to an object
+// allocated by another thread a moment ago is harmless. Ranges only ever
+// widen (see widen_heap_range) until merged into another one.
+static ADDRINT heap_base[HEAP_RANGES];
+static ADDRINT heap_span[HEAP_RANGES];
+static PIN_LOCK range_lock;
 
 /* ===================================================================== */
 // Helper functions
 /* ===================================================================== */
 
-bool is_alloc_func(const char *str) {
-    for (size_t i = 0; i < sizeof(alloc_funcs) / sizeof(alloc_funcs[0]); ++i)
-        if (!strcmp(str, alloc_funcs[i]))
-            return true;
-    return false;
+static inline ThreadAllocs *thread_state(THREADID tid) {
+    return static_cast<ThreadAllocs *>(PIN_GetThreadData(tls_key, tid));
 }
 
-vector<ChainPair> chain_pairs(void) {
-    vector<ChainPair> pairs;
-    pairs.reserve(chains.size());
-    for (ChainMapItr it = chains.begin(); it != chains.end(); ++it)
-        pairs.push_back(*it);
-    return pairs;
+// Take the tables for updating on behalf of thread 'tid', waiting for every
+// reader to finish
+static VOID lock_table(THREADID tid) {
+    PIN_GetLock(&table_lock, tid + 1);
+    for (size_t i = 0; i < readers.size(); ++i)
+        PIN_GetLock(&readers[i]->lock, tid + 1);
 }
 
-bool sort_chain_pairs_by_accesses(const ChainPair &a, const ChainPair &b) {
-    return (contexts[a.second].access_count > contexts[b.second].access_count);
+static VOID unlock_table(void) {
+    for (size_t i = readers.size(); i-- > 0;)
+        PIN_ReleaseLock(&readers[i]->lock);
+    PIN_ReleaseLock(&table_lock);
 }
 
-static bool in_bounds(ADDRINT addr, ADDRINT base, INT32 size) {
-    return (addr >= base) && (addr < ((ADDRINT)base + size));
+// Read the call chain of each context listed in 'filename', as written by
+// write_contexts
+static VOID read_candidates(const string &filename) {
+    ifstream in(filename.c_str());
+    if (!in) {
+        cerr << "ERROR: Failed to open candidate contexts file " << filename
+             << "\n";
+        PIN_ExitApplication(1);
+    }
+    string line, chain;
+    bool in_context = false;
+    while (getline(in, line)) {
+        if (!line.compare(0, 4, "CTX ")) {
+            if (in_context)
+                candidates.insert(chain);
+            chain.clear();
+            in_context = true;
+        } else if (in_context) {
+            chain += line + "\n";
+        }
+    }
+    if (in_context)
+        candidates.insert(chain);
 }
 
-static AddrMapItr get_allocation_itr(ADDRINT addr) {
-    AddrMapItr lower = allocations.lower_bound(addr);
-    if (lower == allocations.end() ||
-        !in_bounds(addr, lower->first, lower->second.size))
-    {
-        return allocations.end();
-    }
-    return lower;
+static bool is_candidate(const ShadowStack::ContextNode *node) {
+    if (candidates.empty())
+        return true;
+    ostringstream chain;
+    chain.setf(ios::showbase);
+    ShadowStack::print(node, chain);
+    return candidates.count(chain.str()) != 0;
 }
 
-static AddrMapItr get_allocation_itr(ObjectRecord obj) {
-    AddrMapItr it = get_allocation_itr(obj.addr);
-    if (it == allocations.end() || it->second.id != obj.id)
-        return allocations.end();
-    return it;
+// Find (or create) the allocation context for the current call chain of
+// thread 'tid'. This is only done once per calling-context tree node, after
+// which it is cached. Chains that don't reduce to a candidate context get
+// UNTRACKED_CONTEXT instead of an id.
+static AllocationContextId get_allocation_context(THREADID tid) {
+    ShadowStack::CallNode *node = ShadowStack::thread_state(tid)->current;
+    if (__builtin_expect(node->context != NO_ALLOCATION_CONTEXT, 1))
+        return node->context;
+
+    // Different call chains (from any thread) may reduce to the same context
+    PIN_GetLock(&context_lock, tid + 1);
+    ShadowStack::ContextNode *reduced = ShadowStack::reduce_chain(node);
+    if (reduced->context == NO_ALLOCATION_CONTEXT) {
+        if (is_candidate(reduced)) {
+            reduced->context = next_context_id++;
+            context_nodes.push_back(reduced);
+        } else {
+            reduced->context = UNTRACKED_CONTEXT;
+        }
+    }
+    PIN_ReleaseLock(&context_lock);
+    node->context = reduced->context;
+    return node->context;
 }
 
-static bool is_allocated(ADDRINT addr) {
-    return get_allocation_itr(addr) == allocations.end();
+// The bytes of gap that widening range 'i' to cover [addr, end) would add
+static ADDRINT heap_range_gap(UINT32 i, ADDRINT addr, ADDRINT end) {
+    ADDRINT range_end = heap_base[i] + heap_span[i];
+    if (addr >= range_end)
+        return addr - range_end;
+    return end < heap_base[i] ? heap_base[i] - end : 0;
 }
 
-static AllocationContextId update_allocation_context(ADDRINT addr) {
-    AllocationContextId context_id;
-    ShadowStack::Chain chain = ShadowStack::get_chain();
-    ObjectRecord obj = { allocations[addr].id, addr };
-    ChainMapItr it = chains.find(chain);
+// Widen range 'i' to cover [addr, end). The span is written first, so that
+// unlocked readers see a superset of the old range throughout.
+static VOID widen_heap_range(UINT32 i, ADDRINT addr, ADDRINT end) {
+    addr = std::min(addr, heap_base[i]);
+    end = std::max(end, heap_base[i] + heap_span[i]);
+    heap_span[i] = end - heap_base[i];
+    __sync_synchronize();
+    heap_base[i] = addr;
+    __sync_synchronize();
+    heap_span[i] = end - addr;
+}
 
-    // If there's no direct match in the chain table, try reducing the chain
-    if (it == chains.end()) {
-        chain = ShadowStack::reduce_chain(chain);
-        it = chains.find(chain);
+// Cover a new allocation: by the nearest range if it's close enough (or no
+// range is free), otherwise by a new range. Ranges the widened range now
+// reaches are merged into it.
+static VOID extend_heap_range(THREADID tid, ADDRINT addr, INT32 size) {
+    if (!addr || size > max_object_size)
+        return;
+    ADDRINT end = addr + (size > 0 ? size : 1);
+    PIN_GetLock(&range_lock, tid + 1);
+    UINT32 nearest = HEAP_RANGES, unused = HEAP_RANGES;
+    ADDRINT nearest_gap = 0;
+    for (UINT32 i = 0; i < HEAP_RANGES; ++i) {
+        if (!heap_span[i]) {
+            unused = std::min(unused, i);
+            continue;
+        }
+        ADDRINT gap = heap_range_gap(i, addr, end);
+        if (nearest == HEAP_RANGES || gap < nearest_gap) {
+            nearest = i;
+            nearest_gap = gap;
+        }
+    }
+    if (nearest != HEAP_RANGES && nearest_gap == 0 &&
+        addr >= heap_base[nearest] &&
+        end <= heap_base[nearest] + heap_span[nearest])
+    {
+        PIN_ReleaseLock(&range_lock);
+        return;
     }
 
-    // Update the chain, context, and allocation tables
-    allocations[addr].successor = allocations[addr].predecessor = 0;
-    if (it == chains.end()) {
-        Context newContext = {};
-
-        ContextTrace << dec << "CTX " << next_context_id << ":" << endl;
-        ShadowStack::print(chain, ContextTrace);
-        if (__builtin_expect(next_context_id == MAX_ALLOC_CALL_SITES, 0)) {
-            cerr << "ERROR: Exceeded maximum allocation call site limit\n";
-            PIN_ExitApplication(1);
-        }
-        newContext.last_object = obj;
-        context_id = next_context_id++;
-        contexts[context_id] = newContext;
-        chains[chain] = context_id;
+    if (unused != HEAP_RANGES &&
+        (nearest == HEAP_RANGES || nearest_gap > HEAP_RANGE_GAP))
+    {
+        heap_base[unused] = addr;
+        __sync_synchronize();
+        heap_span[unused] = end - addr;
     } else {
-        context_id = it->second;
-
-        // Update 'predecessor' and 'successor' allocations
-        ObjectRecord prev_obj = contexts[context_id].last_object;
-        AddrMapItr prev_alloc = get_allocation_itr(prev_obj);
-        allocations[addr].predecessor = prev_obj.id;
-        if (prev_alloc != allocations.end())
-            prev_alloc->second.successor = obj.id;
-        contexts[context_id].last_object = obj;
+        widen_heap_range(nearest, addr, end);
+        ADDRINT base = heap_base[nearest];
+        ADDRINT range_end = base + heap_span[nearest];
+        for (UINT32 i = 0; i < HEAP_RANGES; ++i) {
+            if (i == nearest || !heap_span[i] ||
+                heap_range_gap(i, base, range_end) > HEAP_RANGE_GAP)
+            {
+                continue;
+            }
+            widen_heap_range(nearest, heap_base[i],
+                             heap_base[i] + heap_span[i]);
+            base = heap_base[nearest];
+            range_end = base + heap_span[nearest];
+            heap_span[i] = 0;
+        }
     }
-    return context_id;
+    PIN_ReleaseLock(&range_lock);
 }
 
-static VOID profile_allocation(ADDRINT addr, INT32 size, BOOL realloc) {
-    // Only trace allocations smaller than the maximum size
-    if (size > KnobMaxSize.Value()) {
-        if (realloc)
-            allocations.erase(addr);
+// Resolve the context of a new allocation on the application thread, and
+// either record it immediately or queue it behind any buffered accesses.
+// Objects from untracked contexts are dropped, except that a reallocation
+// still ends the life of any object recorded at its address (as it does for
+// large objects).
+static VOID trace_allocation(THREADID tid, ADDRINT addr, INT32 size,
+                             BOOL realloc)
+{
+    AllocationContextId context = 0;
+    UINT64 time = thread_state(tid)->instr_count;
+    if (size <= max_object_size)
+        context = get_allocation_context(tid);
+    bool untracked = context == UNTRACKED_CONTEXT;
+    if (!untracked)
+        extend_heap_range(tid, addr, size);
+    if (TraceBuffer::enabled) {
+        if (!untracked) {
+            TraceBuffer::append_event(tid, realloc ? TRACE_REALLOC
+                                                   : TRACE_ALLOC,
+                                      addr, size, context, time);
+        } else if (realloc) {
+            TraceBuffer::append_event(tid, TRACE_FREE, addr, 0, 0, time);
+        }
         return;
     }
 
-    // Record the allocation
-    allocations[addr].size = size;
-    if (!realloc)
-        allocations[addr].id = next_object_id++;
-    allocations[addr].context = update_allocation_context(addr);
-    allocations[addr].mark = 0;
+    // Reallocations are only profiled if they move the object
+    lock_table(tid);
+    if (!untracked && (!realloc || !is_allocated(addr))) {
+        profile_allocation(addr, size, realloc, context, time);
+    } else if (untracked && realloc) {
+        ObjectSlot slot = find_allocation(addr);
+        if (slot)
+            profile_free(slot, time);
+    }
+    unlock_table();
 }
 
-static VOID profile_free(AddrMapItr it) {
-    allocations.erase(it);
+// Objects may be freed by a different thread to the one that allocated them
+static VOID trace_free(THREADID tid, ADDRINT ptr) {
+    UINT64 time = thread_state(tid)->instr_count;
+    if (TraceBuffer::enabled) {
+        TraceBuffer::append_event(tid, TRACE_FREE, ptr, 0, 0, time);
+        return;
+    }
+
+    lock_table(tid);
+    ObjectSlot slot = find_allocation(ptr);
+    if (slot)
+        profile_free(slot, time);
+    unlock_table();
 }
 
 /* ================================================================== */
 // Analysis functions
 /* ================================================================== */
 
-VOID PIN_FAST_ANALYSIS_CALL trace_return(CHAR *name, ADDRINT addr) {
-    if (__builtin_expect(!strcmp(name, POSIX_MEMALIGN), 0))
-        addr = *static_cast<ADDRINT *>(last_allocation_dest);
-    if (__builtin_expect((strcmp(name, REALLOC) || is_allocated(addr)) &&
-                         ShadowStack::entered_main, 1))
-        profile_allocation(addr, last_allocation_size, !strcmp(name, REALLOC));
+// Return non-zero if 'addr' might belong to a tracked object. The ranges are
+// checked without branches, to stay simple enough for Pin to inline as an
+// 'if' call.
+ADDRINT PIN_FAST_ANALYSIS_CALL in_heap_range(ADDRINT addr) {
+    return (addr - heap_base[0] < heap_span[0]) |
+           (addr - heap_base[1] < heap_span[1]) |
+           (addr - heap_base[2] < heap_span[2]) |
+           (addr - heap_base[3] < heap_span[3]);
 }
 
-VOID PIN_FAST_ANALYSIS_CALL trace_call1(CHAR *name, ADDRINT ip,
-                                        THREADID tid, ADDRINT param1)
+// Allocators called within the outermost one are entered with a lower stack
+// pointer. An entry at or above the outermost call's stack pointer means that
+// call never returned normally (e.g. 'operator new' threw and was unwound),
+// so the depth is reset rather than hiding the thread's later allocations.
+VOID PIN_FAST_ANALYSIS_CALL trace_allocator_entry(const Allocator *a,
+                                                  THREADID tid, ADDRINT sp,
+                                                  ADDRINT size, ADDRINT count,
+                                                  ADDRINT dest, ADDRINT ptr)
 {
-    if (!strcmp(name, MALLOC)) {
-        last_allocation_size = (INT32)param1;
-    } else if (!strcmp(name, FREE)) {
-        ADDRINT ptr = param1;
-        AddrMapItr it = allocations.find(ptr);
-        if (!ShadowStack::entered_main || it == allocations.end())
-            return;
-
-        // Process the allocation
-        profile_free(it);
+    ThreadAllocs *t = thread_state(tid);
+    if (t->allocator_depth && sp >= t->allocator_sp)
+        t->allocator_depth = 0;
+    if (t->allocator_depth++)
+        return;
+    t->allocator_sp = sp;
+    if (a->kind == ALLOCATOR_FREE) {
+        if (ShadowStack::entered_main)
+            trace_free(tid, ptr);
+        return;
     }
+    t->last_allocation_size = (INT32)(size * count);
+    t->last_allocation_dest = (VOID *)dest;
+    t->last_allocation_ptr = ptr;
 }
 
-VOID PIN_FAST_ANALYSIS_CALL trace_call2(CHAR *name, ADDRINT ip,
-                                        THREADID tid, ADDRINT param1,
-                                        ADDRINT param2)
+VOID PIN_FAST_ANALYSIS_CALL trace_allocator_exit(const Allocator *a,
+                                                 THREADID tid, ADDRINT addr)
 {
-    if (!strcmp(name, CALLOC)) {
-        // void *calloc(size_t number, size_t size)
-        last_allocation_size = (INT32)(param1 * param2);
-    } else if (!strcmp(name, ALIGNED_ALLOC)) {
-        // void *aligned_alloc(size_t alignment, size_t size)
-        last_allocation_size = (INT32)param2;
-    } else if (!strcmp(name, REALLOC)) {
-        // void *realloc(void *ptr, size_t size)
-        last_allocation_size = (INT32)param2;
+    // Calls already in progress when Pin attached have no matching entry
+    ThreadAllocs *t = thread_state(tid);
+    if (!t->allocator_depth || --t->allocator_depth ||
+        a->kind == ALLOCATOR_FREE)
+    {
+        return;
     }
+    if (__builtin_expect(a->dest_arg != NO_ARG, 0))
+        addr = *static_cast<ADDRINT *>(t->last_allocation_dest);
+    if (__builtin_expect(!ShadowStack::entered_main, 0))
+        return;
+
+    // A reallocation that moved the object has freed the old one (which the
+    // allocator may not have done through a traced free function)
+    bool realloc = a->kind == ALLOCATOR_REALLOC;
+    ADDRINT old = t->last_allocation_ptr;
+    if (realloc && addr && old && old != addr)
+        trace_free(tid, old);
+    trace_allocation(tid, addr, t->last_allocation_size, realloc);
 }
 
-VOID PIN_FAST_ANALYSIS_CALL trace_call3(CHAR *name, ADDRINT ip,
-                                        THREADID tid, ADDRINT param1,
-                                        ADDRINT param2, ADDRINT param3)
+// Instructions are counted per thread, and added to 'instr_count' every
+// INSTR_COUNT_BATCH instructions and when the thread exits. The limit applies
+// to the total of all threads: a thread stops the run once the total so far
+// plus its own uncounted instructions reaches it, so multi-threaded runs may
+// overshoot by up to a batch per thread.
+VOID PIN_FAST_ANALYSIS_CALL trace_bbl_executed(THREADID tid,
+                                               ADDRINT num_instrs)
 {
-    if (!strcmp(name, POSIX_MEMALIGN)) {
-        // int posix_memalign(void **ptr, size_t alignment, size_t size)
-        last_allocation_dest = (VOID *)param1;
-        last_allocation_size = (INT32)param3;
+    ThreadAllocs *t = thread_state(tid);
+    if (ShadowStack::entered_main) {
+        t->instr_count += num_instrs;
+        if (__builtin_expect(clock_interval &&
+                             t->instr_count >= t->next_clock, 0))
+        {
+            t->next_clock = (t->instr_count / clock_interval + 1) *
+                            clock_interval;
+            DynAccessTracer::clock_tick(tid, t->instr_count);
+        }
+        UINT64 uncounted = t->instr_count - t->counted_instrs;
+        if (__builtin_expect(uncounted >= INSTR_COUNT_BATCH, 0)) {
+            __sync_fetch_and_add(&instr_count, uncounted);
+            t->counted_instrs = t->instr_count;
+            uncounted = 0;
+        }
+        if (__builtin_expect(instr_limit &&
+                             instr_count + uncounted >= instr_limit, 0))
+        {
+            Attach::stop();
+        }
     }
-}
-
-VOID PIN_FAST_ANALYSIS_CALL trace_bbl_executed(ADDRINT num_instrs) {
-    if (ShadowStack::entered_main)
-        instr_count += num_instrs;
-    if(__builtin_expect(instr_limit && (instr_count >= instr_limit), 0))
-        PIN_ExitApplication(0);
+    if (__builtin_expect(Attach::expired, 0))
+        Attach::stop();
 }
 
 /* ===================================================================== */
@@ -244,64 +408,99 @@ VOID instrument_trace(TRACE trace, VOID *v) {
     // allocation lifetimes but also for enforcing an optional limit.
     for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
         BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)trace_bbl_executed,
-                       IARG_FAST_ANALYSIS_CALL, IARG_UINT32, BBL_NumIns(bbl),
-                       IARG_END);
+                       IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_UINT32,
+                       BBL_NumIns(bbl), IARG_END);
     }
 }
 
+// Pass argument 'index' of the routine, or 'missing' if it has none
+static VOID add_argument(IARGLIST args, INT32 index, ADDRINT missing) {
+    if (index == NO_ARG)
+        IARGLIST_AddArguments(args, IARG_ADDRINT, missing, IARG_END);
+    else
+        IARGLIST_AddArguments(args, IARG_FUNCARG_ENTRYPOINT_VALUE, index,
+                              IARG_END);
+}
+
 static VOID instrument_image(IMG img, VOID *v) {
-    for (size_t i = 0; i < sizeof(alloc_funcs) / sizeof(alloc_funcs[0]); ++i) {
-        const char *name = alloc_funcs[i];
-        RTN rtn = RTN_FindByName(img, name);
+    for (size_t i = 0; i < Allocators::functions.size(); ++i) {
+        const Allocator *a = &Allocators::functions[i];
+        RTN rtn = RTN_FindByName(img, a->name.c_str());
 
         // Check whether the routine exists
         if (!RTN_Valid(rtn))
             continue;
 
         // Trace
+        IARGLIST args = IARGLIST_Alloc();
+        add_argument(args, a->size_arg, 0);
+        add_argument(args, a->count_arg, 1);
+        add_argument(args, a->dest_arg, 0);
+        add_argument(args, a->ptr_arg, 0);
         RTN_Open(rtn);
-        switch (alloc_funcs_nparams[i]) {
-          case 1:
-            RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)trace_call1,
-                           IARG_FAST_ANALYSIS_CALL, IARG_PTR, name,
-                           IARG_RETURN_IP, IARG_THREAD_ID,
-                           IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
-            break;
-          case 2:
-            RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)trace_call2,
-                           IARG_FAST_ANALYSIS_CALL, IARG_PTR, name,
-                           IARG_RETURN_IP, IARG_THREAD_ID,
-                           IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
-                           IARG_FUNCARG_ENTRYPOINT_VALUE, 1, IARG_END);
-            break;
-          case 3:
-            RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)trace_call3,
-                           IARG_FAST_ANALYSIS_CALL, IARG_PTR, name,
-                           IARG_RETURN_IP, IARG_THREAD_ID,
-                           IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
-                           IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
-                           IARG_FUNCARG_ENTRYPOINT_VALUE, 2, IARG_END);
-            break;
-        }
-        if (strcmp(name, FREE)) {
-            RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)trace_return,
-                           IARG_FAST_ANALYSIS_CALL, IARG_PTR, name,
-                           IARG_FUNCRET_EXITPOINT_VALUE, IARG_END);
-        }
+        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)trace_allocator_entry,
+                       IARG_FAST_ANALYSIS_CALL, IARG_PTR, a, IARG_THREAD_ID,
+                       IARG_REG_VALUE, REG_STACK_PTR, IARG_IARGLIST, args,
+                       IARG_END);
+        RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)trace_allocator_exit,
+                       IARG_FAST_ANALYSIS_CALL, IARG_PTR, a, IARG_THREAD_ID,
+                       IARG_FUNCRET_EXITPOINT_VALUE, IARG_END);
         RTN_Close(rtn);
+        IARGLIST_Free(args);
+    }
+}
+
+// Write out the call chain of every allocation context
+static VOID write_contexts(ostream &out) {
+    out.setf(ios::showbase);
+    for (AllocationContextId i = 0; i < next_context_id; ++i) {
+        out << dec << "CTX " << i << ":" << endl;
+        ShadowStack::print(context_nodes[i], out);
     }
 }
 
+static VOID thread_start(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
+    ThreadAllocs *t = new ThreadAllocs();
+    PIN_InitLock(&t->lock);
+    PIN_SetThreadData(tls_key, t, tid);
+    PIN_GetLock(&table_lock, tid + 1);
+    readers.push_back(t);
+    PIN_ReleaseLock(&table_lock);
+}
+
+// The thread makes no more heap accesses, so later updates (e.g. processing
+// the rest of its buffered events) no longer wait for its lock
+static VOID thread_fini(THREADID tid, const CONTEXT *ctxt, INT32 code,
+                        VOID *v)
+{
+    ThreadAllocs *t = thread_state(tid);
+    __sync_fetch_and_add(&instr_count, t->instr_count - t->counted_instrs);
+    PIN_GetLock(&table_lock, tid + 1);
+    readers.erase(std::find(readers.begin(), readers.end(), t));
+    PIN_ReleaseLock(&table_lock);
+    delete t;
+    PIN_SetThreadData(tls_key, NULL, tid);
+}
+
 static VOID finalize(INT32 code, VOID *v) {
+    ofstream ContextTrace;
+    ContextTrace.open(KnobContextTraceOutput.Value().c_str());
+    write_contexts(ContextTrace);
     ContextTrace.close();
 }
 
 static void initialize(void) {
+    max_object_size = KnobMaxSize.Value();
     instr_limit = strtoul(KnobInstructionLimit.Value().c_str(), NULL, 0);
+    if (!KnobCandidateContexts.Value().empty())
+        read_candidates(KnobCandidateContexts.Value());
+    tls_key = PIN_CreateThreadDataKey(NULL);
+    PIN_InitLock(&table_lock);
+    PIN_InitLock(&context_lock);
+    PIN_InitLock(&range_lock);
     IMG_AddInstrumentFunction(instrument_image, 0);
     TRACE_AddInstrumentFunction(instrument_trace, 0);
-    PIN_AddFiniFunction(finalize, 0);
-    ContextTrace.open(KnobContextTraceOutput.Value().c_str());
-    ContextTrace.setf(ios::showbase);
+    Attach::add_thread_functions(thread_start, thread_fini);
+    Attach::add_fini_function(finalize);
 }
 }
@@ -0,0 +1,302 @@
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+// Edges are undirected, so keys always pack the larger context id first. Each
+// edge has a row of 'stride' weights, e.g. one per affinity distance bucket.
+//
+// A table may be bounded to at most 'max_size' edges. Once full, it evicts
+// its lighter half into a count-min sketch (with 'stride' counters per cell),
+// and an evicted edge seen again starts from its estimated weight in the
+// sketch. Evicting raises the edge's cells to at least its weight rather than
+// adding to them (a conservative update), so the weight it was readmitted with
+// isn't counted twice. Cells never shrink, so the heaviest edges are kept and
+// kept weights are never underestimated, only overestimated by what collided
+// with them in the sketch. 'evicted' is the total the sketch's estimates rose
+// by, which bounds that overestimate.
+typedef UINT64 EdgeKey;
+struct EdgeTable {
+    EdgeKey *keys;
+    UINT64 *weights;
+    UINT64 capacity;
+    UINT64 size;
+    UINT32 stride;
+    UINT64 max_size;
+    UINT64 *sketch;
+    UINT64 sketch_width;
+    UINT64 evicted;
+};
+
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+#define EDGE_TABLE_EMPTY   (~0ULL)
+#define EDGE_TABLE_INITIAL (1ULL << 16)
+#define EDGE_SKETCH_DEPTH  4
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static inline EdgeKey edge_key(AllocationContextId a, AllocationContextId b) {
+    if (b > a) { AllocationContextId tmp = a; a = b; b = tmp; }
+    return ((EdgeKey)a << 32) | b;
+}
+
+static inline AllocationContextId edge_src(EdgeKey key) {
+    return (AllocationContextId)(key >> 32);
+}
+
+static inline AllocationContextId edge_dst(EdgeKey key) {
+    return (AllocationContextId)(key & 0xffffffffULL);
+}
+
+static inline UINT64 edge_table_hash(EdgeKey key) {
+    key ^= key >> 29;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    return key ^ (key >> 32);
+}
+
+static VOID edge_table_alloc(EdgeTable *table, UINT64 capacity) {
+    table->keys = (EdgeKey *)malloc(capacity * sizeof(EdgeKey));
+    table->weights = (UINT64 *)calloc(capacity * table->stride,
+                                      sizeof(UINT64));
+    if (!table->keys || !table->weights) {
+        cerr << "ERROR: Failed to allocate affinity edge table\n";
+        PIN_ExitApplication(1);
+    }
+    memset(table->keys, 0xff, capacity * sizeof(EdgeKey));
+    table->capacity = capacity;
+}
+
+static VOID edge_table_init(EdgeTable *table, UINT64 capacity, UINT32 stride) {
+    memset(table, 0, sizeof(*table));
+    table->stride = stride;
+    edge_table_alloc(table, capacity);
+}
+
+// Return the slot holding 'key', or the empty slot where it would be inserted
+static inline UINT64 edge_table_slot(const EdgeTable *table, EdgeKey key) {
+    UINT64 mask = table->capacity - 1;
+    UINT64 ix = edge_table_hash(key) & mask;
+    while (table->keys[ix] != key && table->keys[ix] != EDGE_TABLE_EMPTY)
+        ix = (ix + 1) & mask;
+    return ix;
+}
+
+static VOID edge_table_free(EdgeTable *table) {
+    free(table->keys);
+    free(table->weights);
+    free(table->sketch);
+    table->keys = NULL;
+    table->weights = NULL;
+    table->sketch = NULL;
+    table->capacity = table->size = 0;
+}
+
+// Move every edge into freshly allocated arrays of 'capacity' slots
+static VOID edge_table_rehash(EdgeTable *table, UINT64 capacity) {
+    EdgeKey *old_keys = table->keys;
+    UINT64 *old_weights = table->weights;
+    UINT64 old_capacity = table->capacity;
+    UINT32 stride = table->stride;
+    edge_table_alloc(table, capacity);
+    table->size = 0;
+    for (UINT64 i = 0; i < old_capacity; ++i) {
+        if (old_keys[i] == EDGE_TABLE_EMPTY)
+            continue;
+        UINT64 ix = edge_table_slot(table, old_keys[i]);
+        table->keys[ix] = old_keys[i];
+        memcpy(&table->weights[ix * stride], &old_weights[i * stride],
+               stride * sizeof(UINT64));
+        ++table->size;
+    }
+    free(old_keys);
+    free(old_weights);
+}
+
+// Return the first of the 'stride' counters for 'key' in row 'row' of the
+// sketch
+static inline UINT64 *edge_sketch_cell(const EdgeTable *table, EdgeKey key,
+                                       UINT32 row)
+{
+    UINT64 hash = edge_table_hash(key + (row + 1) * 0x9e3779b97f4a7c15ULL);
+    UINT64 column = hash & (table->sketch_width - 1);
+    return &table->sketch[(row * table->sketch_width + column) *
+                          table->stride];
+}
+
+// Fold the lighter half of the edges into the sketch
+static VOID edge_table_prune(EdgeTable *table) {
+    vector<pair<UINT64, UINT64> > ranked;
+    ranked.reserve(table->size);
+    for (UINT64 i = 0; i < table->capacity; ++i) {
+        if (table->keys[i] == EDGE_TABLE_EMPTY)
+            continue;
+        const UINT64 *row = &table->weights[i * table->stride];
+        UINT64 total = 0;
+        for (UINT32 j = 0; j < table->stride; ++j)
+            total += row[j];
+        ranked.push_back(make_pair(total, i));
+    }
+    size_t lighter = ranked.size() / 2;
+    nth_element(ranked.begin(), ranked.begin() + lighter, ranked.end());
+    for (size_t i = 0; i < lighter; ++i) {
+        UINT64 slot = ranked[i].second;
+        const UINT64 *row = &table->weights[slot * table->stride];
+        UINT64 *cells[EDGE_SKETCH_DEPTH];
+        for (UINT32 r = 0; r < EDGE_SKETCH_DEPTH; ++r)
+            cells[r] = edge_sketch_cell(table, table->keys[slot], r);
+        for (UINT32 j = 0; j < table->stride; ++j) {
+            UINT64 estimate = cells[0][j];
+            for (UINT32 r = 0; r < EDGE_SKETCH_DEPTH; ++r) {
+                estimate = std::min(estimate, cells[r][j]);
+                cells[r][j] = std::max(cells[r][j], row[j]);
+            }
+            if (row[j] > estimate)
+                table->evicted += row[j] - estimate;
+        }
+        table->keys[slot] = EDGE_TABLE_EMPTY;
+    }
+    edge_table_rehash(table, table->capacity);
+}
+
+// Give a newly (re)inserted edge its estimated weight from the sketch. The
+// cells are left alone, as they are shared with colliding edges whose
+// estimates mustn't drop below their true weights.
+static VOID edge_table_readmit(EdgeTable *table, EdgeKey key, UINT64 *row) {
+    UINT64 *cells[EDGE_SKETCH_DEPTH];
+    for (UINT32 r = 0; r < EDGE_SKETCH_DEPTH; ++r)
+        cells[r] = edge_sketch_cell(table, key, r);
+    for (UINT32 j = 0; j < table->stride; ++j) {
+        UINT64 estimate = cells[0][j];
+        for (UINT32 r = 1; r < EDGE_SKETCH_DEPTH; ++r)
+            estimate = std::min(estimate, cells[r][j]);
+        row[j] = estimate;
+    }
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+// Limit the table to 'max_size' edges (see EdgeTable). The table is resized
+// to hold exactly that many below 3/4 occupancy, so that it never grows and
+// each prune only rehashes O(max_size) slots.
+static VOID edge_table_bound(EdgeTable *table, UINT64 max_size) {
+    UINT64 capacity = 1;
+    while (3 * capacity < 4 * max_size)
+        capacity *= 2;
+    edge_table_rehash(table, capacity);
+    table->max_size = max_size;
+    table->sketch_width = 1;
+    while (table->sketch_width < max_size)
+        table->sketch_width *= 2;
+    table->sketch = (UINT64 *)calloc(EDGE_SKETCH_DEPTH * table->sketch_width *
+                                     table->stride, sizeof(UINT64));
+    if (!table->sketch) {
+        cerr << "ERROR: Failed to allocate affinity edge sketch\n";
+        PIN_ExitApplication(1);
+    }
+}
+
+// Return the weights of the edge between contexts 'a' and 'b', adding the edge
+// if necessary. The table only allocates when it passes 3/4 occupancy (or
+// prunes when bounded and full), so steady-state updates are a hash probe and
+// an increment.
+static inline UINT64 *edge_table_insert(EdgeTable *table, AllocationContextId a,
+                                        AllocationContextId b)
+{
+    EdgeKey key = edge_key(a, b);
+    UINT64 ix = edge_table_slot(table, key);
+    if (__builtin_expect(table->keys[ix] == EDGE_TABLE_EMPTY, 0)) {
+        if (table->max_size && table->size >= table->max_size) {
+            edge_table_prune(table);
+            ix = edge_table_slot(table, key);
+        } else if (4 * (table->size + 1) > 3 * table->capacity) {
+            edge_table_rehash(table, table->capacity * 2);
+            ix = edge_table_slot(table, key);
+        }
+        table->keys[ix] = key;
+        ++table->size;
+        if (table->sketch)
+            edge_table_readmit(table, key, &table->weights[ix * table->stride]);
+    }
+    return &table->weights[ix * table->stride];
+}
+
+// Add 'weight' to bucket 'bucket' of the edge between contexts 'a' and 'b'
+static inline VOID edge_table_add(EdgeTable *table, AllocationContextId a,
+                                  AllocationContextId b, UINT32 bucket,
+                                  UINT64 weight)
+{
+    edge_table_insert(table, a, b)[bucket] += weight;
+}
+
+// Return the total weight of buckets [0, 'buckets') of the edge in 'slot'
+static inline UINT64 edge_table_weight(const EdgeTable *table, UINT64 slot,
+                                       UINT32 buckets)
+{
+    const UINT64 *row = &table->weights[slot * table->stride];
+    UINT64 weight = 0;
+    for (UINT32 i = 0; i < buckets; ++i)
+        weight += row[i];
+    return weight;
+}
+
+// Add every edge of 'src' to 'dst', which must have the same stride (and
+// bound, if any)
+static VOID edge_table_merge(EdgeTable *dst, const EdgeTable *src) {
+    for (UINT64 i = 0; i < src->capacity; ++i) {
+        EdgeKey key = src->keys[i];
+        if (key == EDGE_TABLE_EMPTY)
+            continue;
+        UINT64 *row = edge_table_insert(dst, edge_src(key), edge_dst(key));
+        for (UINT32 j = 0; j < src->stride; ++j)
+            row[j] += src->weights[i * src->stride + j];
+    }
+    if (dst->sketch && src->sketch) {
+        UINT64 cells = EDGE_SKETCH_DEPTH * dst->sketch_width * dst->stride;
+        for (UINT64 i = 0; i < cells; ++i)
+            dst->sketch[i] += src->sketch[i];
+        dst->evicted += src->evicted;
+    }
+}
+
+// Remove every edge, keeping the table's capacity
+static VOID edge_table_clear(EdgeTable *table) {
+    if (!table->size)
+        return;
+    memset(table->keys, 0xff, table->capacity * sizeof(EdgeKey));
+    memset(table->weights, 0,
+           table->capacity * table->stride * sizeof(UINT64));
+    table->size = 0;
+    if (table->sketch) {
+        memset(table->sketch, 0, EDGE_SKETCH_DEPTH * table->sketch_width *
+                                 table->stride * sizeof(UINT64));
+        table->evicted = 0;
+    }
+}
+
+// Return the slots of all populated edges, optionally in key order (i.e.
+// ordered by larger then smaller context id)
+struct EdgeSlotLess {
+    const EdgeTable *table;
+    bool operator()(UINT64 a, UINT64 b) const {
+        return table->keys[a] < table->keys[b];
+    }
+};
+
+static vector<UINT64> edge_table_slots(const EdgeTable *table, bool sorted) {
+    vector<UINT64> slots;
+    slots.reserve(table->size);
+    for (UINT64 i = 0; i < table->capacity; ++i)
+        if (table->keys[i] != EDGE_TABLE_EMPTY)
+            slots.push_back(i);
+    if (sorted) {
+        EdgeSlotLess less = { table };
+        sort(slots.begin(), slots.end(), less);
+    }
+    return slots;
+}
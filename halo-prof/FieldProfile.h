@@ -0,0 +1,164 @@
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+// Line pairs are only told apart within each object's first FIELD_LINES cache
+// lines, with later lines counted as the last one
+#define FIELD_LINES 16
+
+// Where heap accesses land within objects: a histogram of the offsets each
+// context's objects are accessed at, and for each affinity edge, which cache
+// lines of the two objects were accessed together. This shows whether the
+// affinity between contexts comes from a few hot fields or whole objects.
+// Kept under the same locking as the cache simulator.
+namespace FieldProfile {
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static bool enabled = false;
+static UINT32 field_bits = 3;
+
+// Access counts of each context by field
+static vector<vector<UINT64> > fields;
+
+// Each edge has a FIELD_LINES x FIELD_LINES row of weights, indexed by the
+// line of the larger context id's object first (see edge_key)
+static EdgeTable line_pairs;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static inline UINT32 clamp_line(UINT32 line) {
+    return std::min(line, (UINT32)FIELD_LINES - 1);
+}
+
+static double ratio(UINT64 a, UINT64 b) {
+    return b ? (double)a / b : 0.0;
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+static VOID configure(UINT32 field_size) {
+    if (!field_size || (field_size & (field_size - 1)) ||
+        field_size > (1U << CACHE_LINE_BITS))
+    {
+        cerr << "ERROR: field size must be a power of two no larger than a "
+                "cache line\n";
+        PIN_ExitApplication(1);
+    }
+    field_bits = __builtin_ctz(field_size);
+    edge_table_init(&line_pairs, EDGE_TABLE_INITIAL / 16,
+                    FIELD_LINES * FIELD_LINES);
+    enabled = true;
+}
+
+// Keep at most 'max_edges' edges' line pairs, like the affinity graphs (see
+// EdgeTable). Each edge's row is FIELD_LINES^2 weights, so this is also what
+// bounds the field profile's memory.
+static VOID bound(UINT64 max_edges) {
+    edge_table_bound(&line_pairs, max_edges);
+}
+
+// Count an access to 'addr' within 'obj'
+static inline VOID object_accessed(AllocationRecord *obj, ADDRINT addr) {
+    if (!enabled)
+        return;
+    if (obj->context >= fields.size())
+        fields.resize(obj->context + 1);
+    vector<UINT64> &counts = fields[obj->context];
+    UINT32 field = (UINT32)((addr - obj->addr) >> field_bits);
+    if (field >= counts.size())
+        counts.resize(field + 1, 0);
+    ++counts[field];
+}
+
+// Count affinity between line 'line_a' of an object from context 'a' and
+// line 'line_b' of one from context 'b'
+static inline VOID lines_accessed(AllocationContextId a, UINT32 line_a,
+                                  AllocationContextId b, UINT32 line_b)
+{
+    if (a < b) {
+        std::swap(a, b);
+        std::swap(line_a, line_b);
+    }
+    edge_table_insert(&line_pairs, a, b)
+        [clamp_line(line_a) * FIELD_LINES + clamp_line(line_b)] += 1;
+}
+
+// Write the field histogram of every accessed context, and the line pairs of
+// every edge between popular contexts (those in the locality graph), as
+// JSON. Counts are unscaled; multiplying them by 'access_scale' and
+// 'edge_scale' estimates those of an unsampled run.
+static VOID write(const string &filename, double access_scale,
+                  double edge_scale)
+{
+    ofstream out;
+    out.open(filename.c_str());
+    out << "{\n  \"field_size\": " << (1U << field_bits)
+        << ",\n  \"line_size\": " << (1U << CACHE_LINE_BITS)
+        << ",\n  \"max_lines\": " << FIELD_LINES
+        << ",\n  \"access_scale\": " << access_scale
+        << ",\n  \"edge_scale\": " << edge_scale
+        << ",\n  \"contexts\": [";
+    const char *separator = "\n";
+    for (AllocationContextId i = 0; i < fields.size(); ++i) {
+        const vector<UINT64> &counts = fields[i];
+        UINT64 total = 0, hottest = 0;
+        for (size_t j = 0; j < counts.size(); ++j) {
+            total += counts[j];
+            hottest = std::max(hottest, counts[j]);
+        }
+        if (!total)
+            continue;
+        out << separator << "    {\"id\": " << i
+            << ", \"popular\": "
+            << (DynAllocTracer::contexts[i].mark ? "true" : "false")
+            << ", \"accesses\": " << total
+            << ", \"hottest_field_fraction\": " << ratio(hottest, total)
+            << ",\n     \"fields\": [";
+        const char *field_separator = "";
+        for (size_t j = 0; j < counts.size(); ++j) {
+            if (!counts[j])
+                continue;
+            out << field_separator << "{\"offset\": " << (j << field_bits)
+                << ", \"count\": " << counts[j] << "}";
+            field_separator = ", ";
+        }
+        out << "]}";
+        separator = ",\n";
+    }
+
+    out << "\n  ],\n  \"edges\": [";
+    separator = "\n";
+    vector<UINT64> slots = edge_table_slots(&line_pairs, true);
+    for (size_t i = 0; i < slots.size(); ++i) {
+        EdgeKey key = line_pairs.keys[slots[i]];
+        AllocationContextId src = edge_src(key), dst = edge_dst(key);
+        if (!DynAllocTracer::contexts[src].mark ||
+            !DynAllocTracer::contexts[dst].mark)
+        {
+            continue;
+        }
+        const UINT64 *row = &line_pairs.weights[slots[i] * line_pairs.stride];
+        out << separator << "    {\"src\": " << src << ", \"dst\": " << dst
+            << ", \"lines\": [";
+        const char *pair_separator = "";
+        for (UINT32 j = 0; j < line_pairs.stride; ++j) {
+            if (!row[j])
+                continue;
+            out << pair_separator << "{\"src_line\": " << j / FIELD_LINES
+                << ", \"dst_line\": " << j % FIELD_LINES
+                << ", \"count\": " << row[j] << "}";
+            pair_separator = ", ";
+        }
+        out << "]}";
+        separator = ",\n";
+    }
+    out << "\n  ]\n}\n";
+    out.close();
+}
+}
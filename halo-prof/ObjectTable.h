@@ -0,0 +1,288 @@
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+typedef UINT64 ObjectId;
+typedef UINT32 AllocationContextId;
+struct ObjectRecord {
+    ObjectId id;
+    ADDRINT addr;
+};
+struct AllocationRecord {
+    ADDRINT addr;
+    ObjectId id;
+    ObjectId predecessor, successor;
+    INT32 size;
+    AllocationContextId context;
+    bool page_counted; // Counted towards its context's working set (PageGraph)
+};
+struct Context {
+    ObjectRecord last_object;
+    UINT64 access_count;
+    UINT32 mark;
+};
+
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+// Object records are allocated in fixed-size chunks, so that they never move
+#define OBJECT_CHUNK_BITS 16
+#define OBJECT_CHUNK_SIZE (1U << OBJECT_CHUNK_BITS)
+#define MAX_OBJECT_SLOTS  (~(ObjectSlot)0)
+
+// Keep the affinity window in step with the object table (AffinityGraph.h)
+namespace DynAccessTracer {
+static VOID object_linked(AllocationRecord *record);
+static VOID object_freed(AllocationRecord *record);
+}
+
+// Gather heap statistics as objects come and go (ContextReport.h)
+namespace ContextReport {
+static VOID object_allocated(ObjectSlot slot, AllocationRecord *record,
+                             UINT64 time);
+static VOID object_freed(ObjectSlot slot, AllocationRecord *record,
+                         UINT64 time);
+}
+
+// Simulate the cache behaviour of each object as it would be grouped
+// (CacheSim.h)
+namespace CacheSim {
+static VOID object_allocated(ObjectSlot slot, AllocationRecord *record);
+static VOID object_freed(ObjectSlot slot, AllocationRecord *record);
+}
+
+// Track the working set of each context as objects change size (PageGraph.h)
+namespace PageGraph {
+static VOID object_reallocated(AllocationRecord *record);
+}
+
+// The live objects and allocation contexts of the profiled program. None of
+// this depends on Pin, so that recorded heap traces can be replayed through
+// the same code offline (see halo-analyze.cpp). Callers are responsible for
+// any locking.
+namespace DynAllocTracer {
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static vector<AllocationRecord *> object_chunks;
+static ObjectSlot num_slots = 1; // Slot 0 means 'no object'
+static vector<ObjectSlot> free_slots;
+static vector<Context> contexts;
+static AllocationContextId next_context_id = 0;
+static ObjectId next_object_id = 1;
+static INT32 max_object_size = 0;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static inline AllocationRecord *object_at(ObjectSlot slot) {
+    return &object_chunks[slot >> OBJECT_CHUNK_BITS]
+                         [slot & (OBJECT_CHUNK_SIZE - 1)];
+}
+
+// Return the ids of every allocation context (only once all threads have
+// finished, as this also makes sure each one has an entry in 'contexts')
+vector<AllocationContextId> context_ids(void) {
+    contexts.resize(next_context_id, Context());
+    vector<AllocationContextId> ids;
+    ids.reserve(next_context_id);
+    for (AllocationContextId i = 0; i < next_context_id; ++i)
+        ids.push_back(i);
+    return ids;
+}
+
+bool sort_contexts_by_accesses(AllocationContextId a, AllocationContextId b) {
+    return (contexts[a].access_count > contexts[b].access_count);
+}
+
+static bool in_bounds(ADDRINT addr, ADDRINT base, INT32 size) {
+    return (addr >= base) && (addr < ((ADDRINT)base + size));
+}
+
+// Return the newest of the objects sharing the granule of 'addr' that
+// contains it (or, if 'exact', starts at it)
+static ObjectSlot shared_allocation_slot(ADDRINT addr, bool exact) {
+    const vector<ObjectSlot> &slots = ShadowMemory::shared_slots(addr);
+    for (size_t i = slots.size(); i--; ) {
+        AllocationRecord *record = object_at(slots[i]);
+        if (exact ? record->addr == addr
+                  : in_bounds(addr, record->addr, record->size))
+        {
+            return slots[i];
+        }
+    }
+    return 0;
+}
+
+// Return the slot of the live object containing 'addr', if any
+static ObjectSlot allocation_slot(ADDRINT addr) {
+    ObjectSlot slot = ShadowMemory::lookup(addr);
+    if (__builtin_expect(slot == SHADOW_SHARED_CELL, 0))
+        return shared_allocation_slot(addr, false);
+    if (!slot)
+        return 0;
+    AllocationRecord *record = object_at(slot);
+    if (!in_bounds(addr, record->addr, record->size))
+        return 0;
+    return slot;
+}
+
+// Return the live object containing 'addr', if any
+static AllocationRecord *get_allocation(ADDRINT addr) {
+    ObjectSlot slot = allocation_slot(addr);
+    return slot ? object_at(slot) : NULL;
+}
+
+static AllocationRecord *get_allocation(ObjectRecord obj) {
+    AllocationRecord *record = get_allocation(obj.addr);
+    if (!record || record->id != obj.id)
+        return NULL;
+    return record;
+}
+
+// Return the slot of the live object starting exactly at 'addr', if any
+static ObjectSlot find_allocation(ADDRINT addr) {
+    ObjectSlot slot = ShadowMemory::lookup(addr);
+    if (__builtin_expect(slot == SHADOW_SHARED_CELL, 0))
+        return shared_allocation_slot(addr, true);
+    if (!slot || object_at(slot)->addr != addr)
+        return 0;
+    return slot;
+}
+
+static bool is_allocated(ADDRINT addr) {
+    return get_allocation(addr) != NULL;
+}
+
+// Link an allocation to the previous object allocated from the same context.
+// Contexts get an entry the first time they're used.
+static VOID link_allocation(ObjectSlot slot, AllocationContextId context_id) {
+    AllocationRecord *record = object_at(slot);
+    ObjectRecord obj = { record->id, record->addr };
+    if (context_id >= contexts.size())
+        contexts.resize(context_id + 1, Context());
+    Context *context = &contexts[context_id];
+
+    // Update the context and allocation tables
+    record->context = context_id;
+    record->successor = record->predecessor = 0;
+    if (context->last_object.id) {
+        // Update 'predecessor' and 'successor' allocations
+        ObjectRecord prev_obj = context->last_object;
+        AllocationRecord *prev_alloc = get_allocation(prev_obj);
+        record->predecessor = prev_obj.id;
+        if (prev_alloc) {
+            prev_alloc->successor = obj.id;
+            DynAccessTracer::object_linked(prev_alloc);
+        }
+    }
+    context->last_object = obj;
+    DynAccessTracer::object_linked(record);
+}
+
+static ObjectSlot new_slot(void) {
+    if (!free_slots.empty()) {
+        ObjectSlot slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+
+    if (__builtin_expect(num_slots == MAX_OBJECT_SLOTS, 0)) {
+        cerr << "ERROR: Exceeded maximum number of live objects\n";
+        PIN_ExitApplication(1);
+    }
+    if ((num_slots >> OBJECT_CHUNK_BITS) == object_chunks.size()) {
+        AllocationRecord *chunk = (AllocationRecord *)calloc(
+            OBJECT_CHUNK_SIZE, sizeof(AllocationRecord));
+        if (!chunk) {
+            cerr << "ERROR: Failed to allocate object table\n";
+            PIN_ExitApplication(1);
+        }
+        object_chunks.push_back(chunk);
+    }
+    return num_slots++;
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+// Allocation events are timestamped with the instruction count of the thread
+// that made them
+static VOID profile_free(ObjectSlot slot, UINT64 time) {
+    AllocationRecord *record = object_at(slot);
+    ContextReport::object_freed(slot, record, time);
+    CacheSim::object_freed(slot, record);
+    DynAccessTracer::object_freed(record);
+    ShadowMemory::clear(record->addr, record->size, slot);
+    record->addr = 0;
+    record->id = 0;
+    free_slots.push_back(slot);
+}
+
+static VOID profile_allocation(ADDRINT addr, INT32 size, BOOL realloc,
+                               AllocationContextId context, UINT64 time)
+{
+    ObjectSlot slot = find_allocation(addr);
+
+    // Only trace allocations smaller than the maximum size
+    if (size > max_object_size) {
+        if (realloc && slot)
+            profile_free(slot, time);
+        return;
+    }
+
+    // Record the allocation, replacing any stale record at the same address
+    AllocationRecord *record;
+    if (slot) {
+        record = object_at(slot);
+        ContextReport::object_freed(slot, record, time);
+        CacheSim::object_freed(slot, record);
+        ShadowMemory::clear(addr, record->size, slot);
+        if (!realloc) {
+            DynAccessTracer::object_freed(record);
+            record->id = next_object_id++;
+            record->page_counted = false;
+        } else {
+            PageGraph::object_reallocated(record);
+        }
+    } else {
+        slot = new_slot();
+        record = object_at(slot);
+        record->id = next_object_id++;
+        record->page_counted = false;
+    }
+    record->addr = addr;
+    record->size = size;
+    ShadowMemory::fill(addr, size, slot);
+    link_allocation(slot, context);
+    ContextReport::object_allocated(slot, record, time);
+    CacheSim::object_allocated(slot, record);
+}
+
+// Apply a buffered allocation event (see DynAllocTracer::trace_allocation
+// and trace_free) made at instruction count 'time'
+static VOID process_event(const TraceRecord *record, UINT64 time) {
+    ObjectSlot slot;
+    switch (record->type) {
+      case TRACE_REALLOC:
+        if (is_allocated(record->addr))
+            break;
+        profile_allocation(record->addr, record->size, true, record->context,
+                           time);
+        break;
+      case TRACE_ALLOC:
+        profile_allocation(record->addr, record->size, false, record->context,
+                           time);
+        break;
+      case TRACE_FREE:
+        slot = find_allocation(record->addr);
+        if (slot)
+            profile_free(slot, time);
+        break;
+    }
+}
+}
@@ -0,0 +1,145 @@
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+// Objects leave the page window after this many distinct object accesses,
+// however few pages those span, to bound the cost of each access
+#define PAGE_WINDOW_ACCESSES 1024
+
+// A second locality graph aimed at TLB reach rather than cache lines: the
+// contexts of objects accessed within a window of distinct pages of each
+// other. Each context's node also carries its working set, the peak bytes of
+// its accessed objects live at once, so that halo-group can size groups to
+// fit in a number of pages. Like the cache simulator, all threads share one
+// window, under the same locking.
+namespace PageGraph {
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static bool enabled = false;
+static UINT32 page_bits = PAGE_BITS;
+static AffinityWindow window;
+static EdgeTable graph;
+static ObjectId last_object = 0;
+
+// The live and peak bytes of each context's accessed objects. Objects are
+// counted towards these when first accessed (see page_counted).
+static vector<UINT64> live_bytes;
+static vector<UINT64> peak_bytes;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static UINT64 scale(UINT64 count, double factor) {
+    return (UINT64)(count * factor + 0.5);
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+static VOID configure(UINT64 page_size, UINT32 pages) {
+    if (page_size < (1ULL << PAGE_BITS) || (page_size & (page_size - 1))) {
+        cerr << "ERROR: page size must be a power of two no smaller than "
+             << (1U << PAGE_BITS) << "\n";
+        PIN_ExitApplication(1);
+    }
+    if (pages < 2) {
+        cerr << "ERROR: page window must be at least two pages\n";
+        PIN_ExitApplication(1);
+    }
+    page_bits = __builtin_ctzll(page_size);
+    affinity_window_init(&window, AFFINITY_LINES, (UINT64)pages << page_bits,
+                         PAGE_WINDOW_ACCESSES, 0, page_bits);
+    edge_table_init(&graph, EDGE_TABLE_INITIAL, 1);
+    enabled = true;
+}
+
+// Count an access of 'size' bytes to 'addr' within 'obj', which only takes
+// part in affinity if 'obj' is sampled
+static inline VOID object_accessed(AllocationRecord *obj, ADDRINT addr,
+                                   INT32 size, bool sampled)
+{
+    if (obj->id == last_object) {
+        affinity_window_repeat(&window, addr, size, 0);
+        return;
+    }
+    last_object = obj->id;
+    if (!obj->page_counted) {
+        obj->page_counted = true;
+        if (obj->context >= live_bytes.size()) {
+            live_bytes.resize(obj->context + 1, 0);
+            peak_bytes.resize(obj->context + 1, 0);
+        }
+        live_bytes[obj->context] += obj->size;
+        peak_bytes[obj->context] = std::max(peak_bytes[obj->context],
+                                            live_bytes[obj->context]);
+    }
+    if (sampled)
+        affinity_window_access(&window, obj, addr, size, 0, 0, &graph);
+    else
+        affinity_window_skip(&window, addr, size, 0);
+}
+
+static VOID object_linked(AllocationRecord *record) {
+    if (enabled)
+        affinity_window_update(&window, record);
+}
+
+// Stop counting an object towards its context's working set
+static VOID uncount(AllocationRecord *record) {
+    if (record->page_counted) {
+        record->page_counted = false;
+        live_bytes[record->context] -= record->size;
+    }
+}
+
+static VOID object_freed(AllocationRecord *record) {
+    if (!enabled)
+        return;
+    affinity_window_remove(&window, record->id);
+    uncount(record);
+}
+
+// An object reallocated in place is counted again (at its new size and
+// context) when it's next accessed
+static VOID object_reallocated(AllocationRecord *record) {
+    if (enabled)
+        uncount(record);
+}
+
+// Write the page graph between popular contexts (those in the locality
+// graph) as TGF, each node labelled with its access count and working set.
+// Counts are scaled up as in the locality graph.
+static VOID write(const string &filename, double node_scale,
+                  double edge_scale)
+{
+    ofstream out;
+    out.open(filename.c_str());
+    vector<AllocationContextId> contexts = DynAllocTracer::context_ids();
+    for (size_t i = 0; i < contexts.size(); ++i) {
+        AllocationContextId id = contexts[i];
+        const Context &c = DynAllocTracer::contexts[id];
+        if (!c.mark)
+            continue;
+        out << id << " " << scale(c.access_count, node_scale) << " "
+            << (id < peak_bytes.size() ? peak_bytes[id] : 0) << "\n";
+    }
+    out << "#\n";
+    vector<UINT64> edges = edge_table_slots(&graph, true);
+    for (size_t i = 0; i < edges.size(); ++i) {
+        EdgeKey key = graph.keys[edges[i]];
+        AllocationContextId src = edge_src(key), dst = edge_dst(key);
+        if (DynAllocTracer::contexts[src].mark &&
+            DynAllocTracer::contexts[dst].mark)
+        {
+            out << src << " " << dst << " "
+                << scale(edge_table_weight(&graph, edges[i], 1), edge_scale)
+                << "\n";
+        }
+    }
+    out.close();
+}
+}
@@ -0,0 +1,220 @@
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+// Index of an allocation record in the object table (0 means 'no object')
+typedef UINT32 ObjectSlot;
+
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+// Each shadow cell covers one 8-byte granule of the address space, and each
+// leaf covers 2^19 granules (4MiB). Leaves are found through a small
+// open-addressed directory keyed on the upper address bits, so a lookup costs
+// one directory probe plus one cell load in the common case.
+#define SHADOW_GRANULE_BITS 3
+#define SHADOW_LEAF_BITS    19
+#define SHADOW_LEAF_CELLS   (1ULL << SHADOW_LEAF_BITS)
+#define SHADOW_TAG_SHIFT    (SHADOW_GRANULE_BITS + SHADOW_LEAF_BITS)
+#define SHADOW_DIR_INITIAL  1024
+
+// Marks a cell whose granule holds parts of several objects, e.g. the end of
+// one and the start of the next when either isn't 8-byte aligned. Their slots
+// are listed in 'shared_cells' instead. The object table never hands out this
+// slot (see MAX_OBJECT_SLOTS).
+#define SHADOW_SHARED_CELL  (~(ObjectSlot)0)
+
+namespace ShadowMemory {
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+struct DirectoryEntry {
+    ADDRINT tag;
+    ObjectSlot *cells;
+};
+
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static DirectoryEntry *directory = NULL;
+static UINT64 directory_size = 0;
+static UINT64 directory_used = 0;
+
+// The slots of the objects in each shared granule, oldest first, by granule
+static unordered_map<ADDRINT, vector<ObjectSlot> > shared_cells;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static UINT64 hash_tag(ADDRINT tag) {
+    return (tag * 0x9e3779b97f4a7c15ULL) >> 16;
+}
+
+static DirectoryEntry *find_entry(DirectoryEntry *dir, UINT64 size,
+                                  ADDRINT tag)
+{
+    UINT64 mask = size - 1;
+    UINT64 ix = hash_tag(tag) & mask;
+    while (dir[ix].cells && dir[ix].tag != tag)
+        ix = (ix + 1) & mask;
+    return &dir[ix];
+}
+
+static VOID grow_directory(void) {
+    UINT64 new_size = directory_size ? directory_size * 2 : SHADOW_DIR_INITIAL;
+    DirectoryEntry *new_dir = (DirectoryEntry *)calloc(new_size,
+                                                       sizeof(DirectoryEntry));
+    if (!new_dir) {
+        cerr << "ERROR: Failed to allocate shadow memory directory\n";
+        PIN_ExitApplication(1);
+    }
+    for (UINT64 i = 0; i < directory_size; ++i) {
+        if (directory[i].cells)
+            *find_entry(new_dir, new_size, directory[i].tag) = directory[i];
+    }
+    free(directory);
+    directory = new_dir;
+    directory_size = new_size;
+}
+
+// Return the leaf covering 'addr', optionally creating it if it doesn't exist
+static ObjectSlot *get_leaf(ADDRINT addr, bool create) {
+    ADDRINT tag = addr >> SHADOW_TAG_SHIFT;
+    DirectoryEntry *entry = find_entry(directory, directory_size, tag);
+    if (entry->cells || !create)
+        return entry->cells;
+
+    // Keep the directory at most half full so that probe chains stay short
+    if (2 * (directory_used + 1) > directory_size) {
+        grow_directory();
+        entry = find_entry(directory, directory_size, tag);
+    }
+    entry->tag = tag;
+    entry->cells = (ObjectSlot *)calloc(SHADOW_LEAF_CELLS, sizeof(ObjectSlot));
+    if (!entry->cells) {
+        cerr << "ERROR: Failed to allocate shadow memory\n";
+        PIN_ExitApplication(1);
+    }
+    ++directory_used;
+    return entry->cells;
+}
+
+// Apply 'fn' to every cell in [addr, addr + size) and its granule, creating
+// leaves as needed
+template <typename F>
+static VOID for_each_cell(ADDRINT addr, ADDRINT size, bool create, F fn) {
+    ADDRINT first = addr >> SHADOW_GRANULE_BITS;
+    ADDRINT last = (addr + (size ? size : 1) - 1) >> SHADOW_GRANULE_BITS;
+    while (first <= last) {
+        ADDRINT leaf_end = (first | (SHADOW_LEAF_CELLS - 1)) + 1;
+        ADDRINT end = std::min(leaf_end, last + 1);
+        ObjectSlot *cells = get_leaf(first << SHADOW_GRANULE_BITS, create);
+        if (cells) {
+            for (ADDRINT i = first; i < end; ++i)
+                fn(cells[i & (SHADOW_LEAF_CELLS - 1)], i);
+        }
+        first = end;
+    }
+}
+
+// Add 'slot' to the objects in 'granule', sharing its cell if need be
+static VOID share_cell(ObjectSlot &cell, ADDRINT granule, ObjectSlot slot) {
+    vector<ObjectSlot> &slots = shared_cells[granule];
+    if (cell != SHADOW_SHARED_CELL) {
+        slots.assign(1, cell);
+        cell = SHADOW_SHARED_CELL;
+    }
+    if (find(slots.begin(), slots.end(), slot) == slots.end())
+        slots.push_back(slot);
+}
+
+// Remove 'slot' from the objects in shared 'granule', handing the cell back to
+// the last one left
+static VOID unshare_cell(ObjectSlot &cell, ADDRINT granule, ObjectSlot slot) {
+    vector<ObjectSlot> &slots = shared_cells[granule];
+    slots.erase(remove(slots.begin(), slots.end(), slot), slots.end());
+    if (slots.size() > 1)
+        return;
+    cell = slots.empty() ? 0 : slots[0];
+    shared_cells.erase(granule);
+}
+
+// Granules the object only partly covers ('first' and 'last', if partial) are
+// shared with any object already there. Any other granule is the object's
+// alone, replacing whatever stale object it overlaps.
+struct FillCell {
+    ObjectSlot slot;
+    ADDRINT first, last;
+    void operator()(ObjectSlot &cell, ADDRINT granule) const {
+        if (cell && cell != slot && (granule == first || granule == last)) {
+            share_cell(cell, granule, slot);
+            return;
+        }
+        if (cell == SHADOW_SHARED_CELL)
+            shared_cells.erase(granule);
+        cell = slot;
+    }
+};
+
+struct ClearCell {
+    ObjectSlot slot;
+    void operator()(ObjectSlot &cell, ADDRINT granule) const {
+        if (cell == slot)
+            cell = 0;
+        else if (cell == SHADOW_SHARED_CELL)
+            unshare_cell(cell, granule, slot);
+    }
+};
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+// Return the slot of the most recent object recorded as covering 'addr', if
+// any, or SHADOW_SHARED_CELL if its granule is shared (see shared_slots).
+// Callers must still check the returned object's bounds.
+static inline ObjectSlot lookup(ADDRINT addr) {
+    ADDRINT tag = addr >> SHADOW_TAG_SHIFT;
+    UINT64 mask = directory_size - 1;
+    UINT64 ix = hash_tag(tag) & mask;
+    while (directory[ix].cells) {
+        if (directory[ix].tag == tag) {
+            ADDRINT cell = (addr >> SHADOW_GRANULE_BITS) &
+                           (SHADOW_LEAF_CELLS - 1);
+            return directory[ix].cells[cell];
+        }
+        ix = (ix + 1) & mask;
+    }
+    return 0;
+}
+
+// Return the slots of the objects in the shared granule holding 'addr'
+static inline const vector<ObjectSlot> &shared_slots(ADDRINT addr) {
+    return shared_cells.find(addr >> SHADOW_GRANULE_BITS)->second;
+}
+
+// Map every granule of [addr, addr + size) to 'slot'
+static VOID fill(ADDRINT addr, ADDRINT size, ObjectSlot slot) {
+    ADDRINT end = addr + (size ? size : 1);
+    FillCell fn = { slot, ~(ADDRINT)0, ~(ADDRINT)0 };
+    if (addr & ((1 << SHADOW_GRANULE_BITS) - 1))
+        fn.first = addr >> SHADOW_GRANULE_BITS;
+    if (end & ((1 << SHADOW_GRANULE_BITS) - 1))
+        fn.last = (end - 1) >> SHADOW_GRANULE_BITS;
+    for_each_cell(addr, size, true, fn);
+}
+
+// Unmap every granule of [addr, addr + size) still mapped to 'slot'
+static VOID clear(ADDRINT addr, ADDRINT size, ObjectSlot slot) {
+    ClearCell fn = { slot };
+    for_each_cell(addr, size, false, fn);
+}
+
+static void initialize(void) {
+    grow_directory();
+}
+}
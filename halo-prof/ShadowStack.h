@@ -9,22 +9,12 @@ using namespace std::tr1;
 /* ===================================================================== */
 
 #define LONGJMP "__longjmp"
+#define NO_ALLOCATION_CONTEXT 0xffffffffU
 
-#if defined(TARGET_MAC)
-#define MALLOC "_malloc"
-#define CALLOC "_calloc"
-#define POSIX_MEMALIGN "_posix_memalign"
-#define ALIGNED_ALLOC "_aligned_alloc"
-#define REALLOC "_realloc"
-#define FREE "_free"
-#else
-#define MALLOC "malloc"
-#define CALLOC "calloc"
-#define POSIX_MEMALIGN "posix_memalign"
-#define ALIGNED_ALLOC "aligned_alloc"
-#define REALLOC "realloc"
-#define FREE "free"
-#endif
+// Instructions hashed either side of a call site in its stable key
+#define SITE_KEY_RADIUS 4
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
 
 namespace ShadowStack {
 /* ===================================================================== */
@@ -33,6 +23,11 @@ namespace ShadowStack {
 
 KNOB<INT32> KnobMaxStackDepth(KNOB_MODE_WRITEONCE, "pintool",
     "max-stack-depth", "0", "maximum stack depth");
+KNOB<string> KnobSiteKeysOutput(KNOB_MODE_WRITEONCE, "pintool",
+    "site-keys-output", "", "also write a stable key for every call site in "
+    "the main executable, so that profiles can be remapped onto a rebuild");
+KNOB<BOOL> KnobSiteKeysOnly(KNOB_MODE_WRITEONCE, "pintool", "site-keys-only",
+    "0", "exit as soon as the site keys have been written");
 
 /* ================================================================== */
 // Structures and types
@@ -49,19 +44,38 @@ struct CallSite {
     }
 };
 typedef std::vector<CallSite> Chain;
-typedef std::vector<CallSite>::reverse_iterator ChainItr;
+
+// Node in the calling-context tree, representing the call chain from 'main'
+// to this call site. The allocation context of the chain is resolved once and
+// cached in the node.
+struct CallNode {
+    CallSite site;
+    CallNode *parent;
+    vector<CallNode *> children;
+    UINT32 context;
+};
+
+// Node in the tree of reduced (and depth-limited) call chains. Each distinct
+// reduced chain is an allocation context.
+struct ContextNode {
+    CallSite site;
+    string name;
+    ContextNode *parent;
+    vector<ContextNode *> children;
+    UINT32 context;
+};
+
+// Per-thread shadow stack state. Each thread builds its own calling-context
+// tree, so that it can be walked and extended without locking.
+struct ThreadStack {
+    CallNode root;
+    CallNode *current;
+    ADDRINT last_stub_call_site;
+    UINT64 signal_depth;
+};
 }
 
 namespace std {
-    template<typename T> struct hash< vector<T> > {
-        size_t operator()(vector<T> const &v) const {
-            size_t h = 0;
-            for (size_t i = 0; i < v.size(); ++i)
-                h ^= std::hash<T>()(v[i]) + 0x9e3779b9 + (h << 6) + (h >> 2);
-            return h;
-        }
-    };
-
     template<> struct hash<ShadowStack::CallSite> {
         size_t operator()(ShadowStack::CallSite const &v) const {
             return v.hash();
@@ -75,44 +89,126 @@ namespace ShadowStack {
 // Global variables
 /* ================================================================== */
 
-static UINT64 thread_count = 0;
-static UINT64 signal_depth = 0;
 static bool entered_main = false;
-static ADDRINT last_stub_call_site = 0;
-static vector<RTN> ext_traceable_routines;
-static Chain chain;
+static unordered_set<UINT32> ext_traceable_routines;
+static ContextNode context_tree_root;
+static TLS_KEY tls_key;
 
 /* ================================================================== */
 // Helper functions
 /* ================================================================== */
 
-static VOID print(Chain chain, ostream &stream) {
-    ChainItr it = chain.rbegin();
-    while (it != chain.rend()) {
-        stream << "\t" << (RTN_Valid(it->rtn) ? RTN_Name(it->rtn) : "UNKNOWN");
-        stream << " from " << std::hex << it->site << "\n";
-        ++it;
+static inline ThreadStack *thread_state(THREADID tid) {
+    return static_cast<ThreadStack *>(PIN_GetThreadData(tls_key, tid));
+}
+
+static VOID print(const ContextNode *node, ostream &stream) {
+    for (; node != &context_tree_root; node = node->parent) {
+        stream << "\t" << node->name;
+        stream << " from " << std::hex << node->site.site << "\n";
     }
     stream << flush;
 }
 
-#if 0
-static VOID print_compact(Chain chain, ostream &stream, int n) {
-    ChainItr it = chain.rbegin();
-    if (it != chain.rend()) ++it;
-    while (n && it != chain.rend()) {
-        stream << RTN_Name(it->rtn);
-        if (--n && ++it != chain.rend()) stream << ", ";
+// Return the child of 'node' for call site 's', creating it if necessary.
+// Children are kept in most-recently-found order as hot call sites tend to be
+// revisited from the same parent.
+template <typename N>
+static N *get_child(N *node, const CallSite &s) {
+    for (size_t i = 0; i < node->children.size(); ++i) {
+        N *child = node->children[i];
+        if (child->site == s) {
+            if (i)
+                std::swap(node->children[i], node->children[0]);
+            return child;
+        }
     }
-    stream << flush;
+    N *child = new N();
+    child->site = s;
+    child->parent = node;
+    child->context = NO_ALLOCATION_CONTEXT;
+    node->children.push_back(child);
+    return child;
+}
+
+static inline UINT64 hash_value(UINT64 hash, UINT64 value) {
+    for (int i = 0; i < 8; ++i, value >>= 8)
+        hash = (hash ^ (value & 0xff)) * FNV_PRIME;
+    return hash;
+}
+
+static UINT64 hash_string(UINT64 hash, const string &s) {
+    for (size_t i = 0; i < s.size(); ++i)
+        hash = (hash ^ (UINT8)s[i]) * FNV_PRIME;
+    return hash;
+}
+
+// Whether 'ins', in the routine at [start, end), may appear in a call chain:
+// calls, and jumps that may leave the routine (tail calls)
+static bool is_site_ins(INS ins, ADDRINT start, ADDRINT end) {
+    if (INS_IsCall(ins))
+        return true;
+    if (!INS_IsBranch(ins) || INS_IsRet(ins))
+        return false;
+    if (!INS_IsDirectBranchOrCall(ins))
+        return true;
+    ADDRINT target = INS_DirectBranchOrCallTargetAddress(ins);
+    return target < start || target >= end;
+}
+
+// Hash the parts of 'ins' that survive relinking: its opcode, and the name of
+// the routine it calls or jumps to, if that's direct and outside the routine
+// at [start, end). Displacements and immediates are left out.
+static UINT64 hash_ins(UINT64 hash, INS ins, ADDRINT start, ADDRINT end) {
+    hash = hash_value(hash, INS_Opcode(ins));
+    if (INS_IsDirectBranchOrCall(ins)) {
+        ADDRINT target = INS_DirectBranchOrCallTargetAddress(ins);
+        RTN rtn = RTN_FindByAddress(target);
+        if ((target < start || target >= end) && RTN_Valid(rtn))
+            hash = hash_string(hash, RTN_Name(rtn));
+    }
+    return hash;
 }
-#endif
 
+// Write a key for every call site in 'img' that identifies it across
+// rebuilds: the site (as printed in call chains), the routine containing it
+// and its offset there, and a hash of the SITE_KEY_RADIUS instructions either
+// side of it. halo-remap matches these against the keys of a new build.
+static VOID write_site_keys(IMG img, ostream &out) {
+    out.setf(ios::showbase);
+    out << hex;
+    for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)) {
+        for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn)) {
+            ADDRINT start = RTN_Address(rtn);
+            ADDRINT end = start + RTN_Size(rtn);
+            vector<INS> code;
+            RTN_Open(rtn);
+            for (INS ins = RTN_InsHead(rtn); INS_Valid(ins);
+                 ins = INS_Next(ins))
+            {
+                code.push_back(ins);
+            }
+            for (size_t i = 0; i < code.size(); ++i) {
+                if (!is_site_ins(code[i], start, end))
+                    continue;
+                size_t first = i > SITE_KEY_RADIUS ? i - SITE_KEY_RADIUS : 0;
+                size_t last = std::min(code.size(), i + SITE_KEY_RADIUS + 1);
+                UINT64 hash = FNV_OFFSET_BASIS;
+                for (size_t j = first; j < last; ++j)
+                    hash = hash_ins(hash, code[j], start, end);
+                ADDRINT address = INS_Address(code[i]);
+                out << (address - IMG_LoadOffset(img)) << " " << RTN_Name(rtn)
+                    << "+" << (address - start) << " " << hash << "\n";
+            }
+            RTN_Close(rtn);
+        }
+    }
+    out << flush;
+}
+
+// Checked on every traced call, so routines are kept in a set (by id)
 static bool is_ext_traceable_rtn(RTN rtn) {
-    for (size_t i = 0; i < ext_traceable_routines.size(); ++i)
-        if (rtn == ext_traceable_routines[i])
-            return true;
-    return false;
+    return RTN_Valid(rtn) && ext_traceable_routines.count(RTN_Id(rtn));
 }
 
 static int is_stub_rtn(RTN rtn, IMG img) {
@@ -129,35 +225,34 @@ static int is_stub_rtn(RTN rtn, IMG img) {
     return 0;
 }
 
-// Return the current chain (constrained by KnobMaxStackDepth)
-static Chain get_chain() {
-    size_t n = KnobMaxStackDepth.Value();
-    if (n > 0) {
-        Chain result(chain.end() - std::min(chain.size(), n), chain.end());
-        return result;
-    }
-    return chain;
-}
-
-// Reduce a chain such that for any duplicate calls, only the most recent copies
-// are kept
-static Chain reduce_chain(Chain chain) {
+// Return the context tree node for the chain ending at 'node', constrained by
+// KnobMaxStackDepth and reduced such that for any duplicate calls, only the
+// most recent copies are kept. The context tree is shared between threads, so
+// callers must serialise calls to this.
+static ContextNode *reduce_chain(CallNode *node) {
     static unordered_map<CallSite, bool> seen;
-
-    ChainItr it = chain.rbegin();
-    while (it != chain.rend()) {
-        if (seen[*it]) {
-            // Laughably, this appears to be the best way to erase an
-            // element from a vector using a reverse iterator pre-C++11.
-            ChainItr j = it;
-            it = ChainItr(chain.erase((++j).base()));
-        } else {
-            seen[*it] = true;
-            ++it;
+    size_t n = KnobMaxStackDepth.Value();
+    size_t depth = 0;
+    Chain chain;
+
+    // Collect the (most recent first) chain, dropping older duplicates
+    for (; node->parent && (!n || depth++ < n); node = node->parent)
+    {
+        if (!seen[node->site]) {
+            seen[node->site] = true;
+            chain.push_back(node->site);
         }
     }
     seen.clear();
-    return chain;
+
+    // Find the chain in the context tree, starting from the oldest call
+    ContextNode *result = &context_tree_root;
+    for (Chain::reverse_iterator it = chain.rbegin(); it != chain.rend(); ++it) {
+        result = get_child(result, *it);
+        if (result->name.empty())
+            result->name = RTN_Valid(it->rtn) ? RTN_Name(it->rtn) : "UNKNOWN";
+    }
+    return result;
 }
 
 /* ===================================================================== */
@@ -169,34 +264,37 @@ static bool should_trace_branch(RTN rtn, ADDRINT target) {
                               is_ext_traceable_rtn(rtn));
 }
 
-static VOID PIN_FAST_ANALYSIS_CALL trace_stub_call(ADDRINT src) {
-    last_stub_call_site = src;
+static VOID PIN_FAST_ANALYSIS_CALL trace_stub_call(THREADID tid, ADDRINT src) {
+    thread_state(tid)->last_stub_call_site = src;
 }
 
-static VOID PIN_FAST_ANALYSIS_CALL trace_call(ADDRINT src, ADDRINT sp,
-                                              RTN rtn)
+static VOID PIN_FAST_ANALYSIS_CALL trace_call(THREADID tid, ADDRINT src,
+                                              ADDRINT sp, RTN rtn)
 {
+    ThreadStack *t = thread_state(tid);
+
     // If this call is being traced but wasn't in the main executable and
     // doesn't have a corresponding call site, it must have gone through a stub.
     if (!src) {
-        src = last_stub_call_site;
-        last_stub_call_site = 0;
+        src = t->last_stub_call_site;
+        t->last_stub_call_site = 0;
     }
 
     // Don't trace repeated calls or calls before 'main'
-    if (!ShadowStack::entered_main || ShadowStack::chain.back().rtn == rtn)
+    if (!ShadowStack::entered_main || t->current->site.rtn == rtn)
         return;
 
     // Don't trace any routines called within externally traceable routines
-    if (is_ext_traceable_rtn(ShadowStack::chain.back().rtn))
+    if (is_ext_traceable_rtn(t->current->site.rtn))
         return;
 
     // Trace the call
     CallSite s = { src, rtn };
-    ShadowStack::chain.push_back(s);
+    t->current = get_child(t->current, s);
 }
 
-static VOID PIN_FAST_ANALYSIS_CALL trace_indirect_call(ADDRINT src, ADDRINT sp,
+static VOID PIN_FAST_ANALYSIS_CALL trace_indirect_call(THREADID tid,
+                                                       ADDRINT src, ADDRINT sp,
                                                        ADDRINT target)
 {
     if (ShadowStack::entered_main) {
@@ -205,23 +303,24 @@ static VOID PIN_FAST_ANALYSIS_CALL trace_indirect_call(ADDRINT src, ADDRINT sp,
         bool traceable = should_trace_branch(rtn, target);
         PIN_UnlockClient();
         if (traceable)
-            trace_call(src, sp, rtn);
+            trace_call(tid, src, sp, rtn);
     }
 }
 
-static VOID PIN_FAST_ANALYSIS_CALL trace_return(ADDRINT ip, ADDRINT sp,
-                                                ADDRINT ret)
+static VOID PIN_FAST_ANALYSIS_CALL trace_return(THREADID tid, ADDRINT ip,
+                                                ADDRINT sp, ADDRINT ret)
 {
     if (ShadowStack::entered_main) {
+        ThreadStack *t = thread_state(tid);
         PIN_LockClient();
         RTN rtn = RTN_FindByAddress(ret);
         PIN_UnlockClient();
         if (!RTN_Valid(rtn))
             return;
 
-        for (long i = (long)ShadowStack::chain.size() - 1; i >= 0; --i) {
-            if (ShadowStack::chain[i].rtn == rtn) {
-                ShadowStack::chain.resize(i + 1);
+        for (CallNode *node = t->current; node->parent; node = node->parent) {
+            if (node->site.rtn == rtn) {
+                t->current = node;
                 return;
             }
         }
@@ -229,8 +328,8 @@ static VOID PIN_FAST_ANALYSIS_CALL trace_return(ADDRINT ip, ADDRINT sp,
         // Deal with external tracable routines called from library functions...
         // we probably should have dealt with this by just adding all calls to
         // the shadow stack and then reducing them out, but never mind.
-        if (is_ext_traceable_rtn(ShadowStack::chain.back().rtn))
-            ShadowStack::chain.pop_back();
+        if (t->current->parent && is_ext_traceable_rtn(t->current->site.rtn))
+            t->current = t->current->parent;
     }
 }
 
@@ -241,10 +340,10 @@ static VOID trace_signal(THREADID threadIndex,  CONTEXT_CHANGE_REASON reason,
     switch(reason) {
     case CONTEXT_CHANGE_REASON_SIGNAL:
         // NOTE: At current, signals don't contribute to the call site chain
-        ++signal_depth;
+        ++thread_state(threadIndex)->signal_depth;
         break;
     case CONTEXT_CHANGE_REASON_SIGRETURN:
-        --signal_depth;
+        --thread_state(threadIndex)->signal_depth;
         break;
     case CONTEXT_CHANGE_REASON_FATALSIGNAL:
         break;
@@ -259,18 +358,42 @@ static VOID trace_signal(THREADID threadIndex,  CONTEXT_CHANGE_REASON reason,
 
 static VOID trace_main(THREADID tid, RTN rtn)
 {
+    ThreadStack *t = thread_state(tid);
     entered_main = true;
-    if (chain.empty()) {
+    if (t->current == &t->root) {
         CallSite s = { 0, rtn };
-        chain.push_back(s);
+        t->current = get_child(t->current, s);
     }
 }
 
+// Threads other than the main thread start from an empty chain, so their
+// contexts are rooted at the thread's start routine
 static VOID trace_thread_start(THREADID threadIndex, CONTEXT *ctxt, INT32 flags,
                                VOID *v)
 {
-    ++thread_count;
-    ASSERT(thread_count == 1, "This PIN tool does not support multi-threading");
+    ThreadStack *t = new ThreadStack();
+    CallSite root = { 0, RTN_Invalid() };
+    t->root.site = root;
+    t->root.parent = NULL;
+    t->root.context = NO_ALLOCATION_CONTEXT;
+    t->current = &t->root;
+    PIN_SetThreadData(tls_key, t, threadIndex);
+}
+
+static VOID trace_thread_fini(THREADID threadIndex, const CONTEXT *ctxt,
+                              INT32 code, VOID *v)
+{
+    ThreadStack *t = thread_state(threadIndex);
+    vector<CallNode *> pending(t->root.children);
+    while (!pending.empty()) {
+        CallNode *node = pending.back();
+        pending.pop_back();
+        pending.insert(pending.end(), node->children.begin(),
+                       node->children.end());
+        delete node;
+    }
+    delete t;
+    PIN_SetThreadData(tls_key, NULL, threadIndex);
 }
 
 /* ===================================================================== */
@@ -278,6 +401,14 @@ static VOID trace_thread_start(THREADID threadIndex, CONTEXT *ctxt, INT32 flags,
 /* ===================================================================== */
 
 static VOID instrument_image(IMG img, VOID *v) {
+    if (IMG_IsMainExecutable(img) && !KnobSiteKeysOutput.Value().empty()) {
+        ofstream out(KnobSiteKeysOutput.Value().c_str());
+        write_site_keys(img, out);
+        out.close();
+        if (KnobSiteKeysOnly.Value())
+            PIN_ExitApplication(0);
+    }
+
     // Instrument the entry point
     RTN rtn = RTN_FindByName(img, "main");
     if (!RTN_Valid(rtn))
@@ -291,19 +422,11 @@ static VOID instrument_image(IMG img, VOID *v) {
 
     // Keep track of external traceable routines
     rtn = RTN_FindByName(img, LONGJMP);
-    if (RTN_Valid(rtn)) ext_traceable_routines.push_back(rtn);
-    rtn = RTN_FindByName(img, MALLOC);
-    if (RTN_Valid(rtn)) ext_traceable_routines.push_back(rtn);
-    rtn = RTN_FindByName(img, CALLOC);
-    if (RTN_Valid(rtn)) ext_traceable_routines.push_back(rtn);
-    rtn = RTN_FindByName(img, POSIX_MEMALIGN);
-    if (RTN_Valid(rtn)) ext_traceable_routines.push_back(rtn);
-    rtn = RTN_FindByName(img, ALIGNED_ALLOC);
-    if (RTN_Valid(rtn)) ext_traceable_routines.push_back(rtn);
-    rtn = RTN_FindByName(img, REALLOC);
-    if (RTN_Valid(rtn)) ext_traceable_routines.push_back(rtn);
-    rtn = RTN_FindByName(img, FREE);
-    if (RTN_Valid(rtn)) ext_traceable_routines.push_back(rtn);
+    if (RTN_Valid(rtn)) ext_traceable_routines.insert(RTN_Id(rtn));
+    for (size_t i = 0; i < Allocators::functions.size(); ++i) {
+        rtn = RTN_FindByName(img, Allocators::functions[i].name.c_str());
+        if (RTN_Valid(rtn)) ext_traceable_routines.insert(RTN_Id(rtn));
+    }
 }
 
 static VOID instrument_trace(TRACE trace, VOID *v) {
@@ -322,9 +445,10 @@ static VOID instrument_trace(TRACE trace, VOID *v) {
                 IMG_IsMainExecutable(img)) ? (site - IMG_LoadOffset(img)) : 0;
         if (INS_IsRet(tail)) {
             INS_InsertPredicatedCall(tail, IPOINT_BEFORE, (AFUNPTR)trace_return,
-                                     IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE,
-                                     IARG_INST_PTR, REG_STACK_PTR,
-                                     IARG_BRANCH_TARGET_ADDR, IARG_END);
+                                     IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID,
+                                     IARG_INST_PTR, IARG_REG_VALUE,
+                                     REG_STACK_PTR, IARG_BRANCH_TARGET_ADDR,
+                                     IARG_END);
         } else if (INS_IsDirectBranchOrCall(tail)) {
             ADDRINT target = INS_DirectBranchOrCallTargetAddress(tail);
             RTN target_rtn = RTN_FindByAddress(target);
@@ -333,30 +457,41 @@ static VOID instrument_trace(TRACE trace, VOID *v) {
                 if (stub_routine_type == 1) {
                     INS_InsertPredicatedCall(tail, IPOINT_BEFORE,
                                              (AFUNPTR)trace_stub_call,
-                                             IARG_FAST_ANALYSIS_CALL, IARG_PTR,
-                                             site, IARG_END);
+                                             IARG_FAST_ANALYSIS_CALL,
+                                             IARG_THREAD_ID, IARG_PTR, site,
+                                             IARG_END);
                 }
             } else if (should_trace_branch(target_rtn, target)) {
                 INS_InsertPredicatedCall(tail, IPOINT_BEFORE,
                                          (AFUNPTR)trace_call,
-                                         IARG_FAST_ANALYSIS_CALL, IARG_ADDRINT,
-                                         site, IARG_REG_VALUE, REG_STACK_PTR,
+                                         IARG_FAST_ANALYSIS_CALL,
+                                         IARG_THREAD_ID, IARG_ADDRINT, site,
+                                         IARG_REG_VALUE, REG_STACK_PTR,
                                          IARG_PTR, target_rtn, IARG_END);
             }
         } else if (INS_IsIndirectBranchOrCall(tail) && !is_stub_rtn(rtn, img)) {
             INS_InsertPredicatedCall(tail, IPOINT_BEFORE,
                                      (AFUNPTR)trace_indirect_call,
-                                     IARG_FAST_ANALYSIS_CALL, IARG_ADDRINT,
-                                     site, IARG_REG_VALUE, REG_STACK_PTR,
-                                     IARG_BRANCH_TARGET_ADDR, IARG_END);
+                                     IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID,
+                                     IARG_ADDRINT, site, IARG_REG_VALUE,
+                                     REG_STACK_PTR, IARG_BRANCH_TARGET_ADDR,
+                                     IARG_END);
         }
     }
 }
 
 static void initialize(void) {
+    CallSite root = { 0, RTN_Invalid() };
+    context_tree_root.site = root;
+    context_tree_root.context = NO_ALLOCATION_CONTEXT;
+    tls_key = PIN_CreateThreadDataKey(NULL);
+
+    // A process that was attached to is already past 'main', so its call
+    // chains are only built up from whatever each thread calls next
+    entered_main = Attach::attached;
     IMG_AddInstrumentFunction(instrument_image, 0);
     TRACE_AddInstrumentFunction(instrument_trace, 0);
     PIN_AddContextChangeFunction(trace_signal, 0);
-    PIN_AddThreadStartFunction(trace_thread_start, 0);
+    Attach::add_thread_functions(trace_thread_start, trace_thread_fini);
 }
 }
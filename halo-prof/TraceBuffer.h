@@ -0,0 +1,315 @@
+namespace TraceBuffer {
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+
+KNOB<UINT32> KnobTraceBufferSize(KNOB_MODE_WRITEONCE, "pintool",
+    "trace-buffer-size", "0", "number of records per trace buffer (0 "
+    "processes heap accesses immediately, unless they are being recorded)");
+KNOB<UINT32> KnobTraceBuffers(KNOB_MODE_WRITEONCE, "pintool",
+    "trace-buffers", "4", "number of trace buffers in flight per thread");
+
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+#define TRACE_BUFFER_DEFAULT_SIZE 65536
+
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+// The trace buffers of one application thread: the buffer currently being
+// filled (whose records from 'batch_start' on haven't been submitted yet),
+// plus a FIFO of empty buffers waiting to be filled
+struct ThreadBuffers {
+    THREADID tid;
+    TraceRecord *batch_start;
+    TraceRecord *cursor;
+    TraceRecord *buffer_end;
+    TraceRecord **free_buffers;
+    UINT64 free_head, free_tail;
+    UINT64 in_flight;
+};
+
+// Records waiting for the analysis thread. A buffer may be submitted in
+// several batches, the last of which hands the buffer back ('done_buffer')
+// once processed.
+struct Batch {
+    ThreadBuffers *owner;
+    TraceRecord *records;
+    UINT64 count;
+    TraceRecord *done_buffer;
+};
+
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static bool enabled = false;
+static TraceConsumer consumer = NULL;
+static TLS_KEY tls_key;
+
+// Batches from every thread are analysed in the order they're submitted. Each
+// thread submits what it has buffered whenever it records an allocation event,
+// so every event is analysed after any event it depends on, even on another
+// thread (e.g. a free after the allocation it ends). Only accesses may be
+// analysed out of order with other threads' events.
+static UINT64 buffer_size = 0;
+static UINT64 num_buffers = 0;
+static deque<Batch> full_buffers;
+static bool exiting = false;
+
+static PIN_LOCK queue_lock;
+static PIN_SEMAPHORE work_ready;
+static PIN_SEMAPHORE buffer_done;
+static PIN_THREAD_UID worker_uid;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static inline ThreadBuffers *thread_state(THREADID tid) {
+    return static_cast<ThreadBuffers *>(PIN_GetThreadData(tls_key, tid));
+}
+
+// Block until 'cond' holds, using 'sem' to wait for state changes. 'sem' must
+// be set under 'queue_lock' by whoever changes the state.
+template <typename C>
+static VOID wait_for(PIN_SEMAPHORE *sem, C cond) {
+    for (;;) {
+        PIN_GetLock(&queue_lock, 0);
+        if (cond()) {
+            return; // NOTE: Returns with 'queue_lock' held
+        }
+        PIN_SemaphoreClear(sem);
+        PIN_ReleaseLock(&queue_lock);
+        PIN_SemaphoreWait(sem);
+    }
+}
+
+struct HasFreeBuffer {
+    ThreadBuffers *t;
+    bool operator()() const { return t->free_head != t->free_tail; }
+};
+struct HasFullBufferOrExit {
+    bool operator()() const { return !full_buffers.empty() || exiting; }
+};
+struct IsDrained {
+    ThreadBuffers *t;
+    bool operator()() const { return t->in_flight == 0; }
+};
+
+// Hand the records buffered since the last batch to the analysis thread. If
+// 'done', the rest of the buffer is abandoned and the thread starts filling a
+// new one.
+static VOID submit(ThreadBuffers *t, bool done) {
+    TraceRecord *base = t->buffer_end - buffer_size;
+    UINT64 count = t->cursor - t->batch_start;
+    if (!count && !done)
+        return;
+
+    // Once the analysis thread has stopped, buffers are processed in place
+    PIN_GetLock(&queue_lock, 0);
+    if (exiting) {
+        PIN_ReleaseLock(&queue_lock);
+        if (count)
+            consumer(t->tid, t->batch_start, count);
+        if (done)
+            t->cursor = base;
+        t->batch_start = t->cursor;
+        return;
+    }
+    Batch batch = { t, t->batch_start, count, done ? base : NULL };
+    full_buffers.push_back(batch);
+    ++t->in_flight;
+    PIN_SemaphoreSet(&work_ready);
+    PIN_ReleaseLock(&queue_lock);
+    t->batch_start = t->cursor;
+    if (!done)
+        return;
+
+    HasFreeBuffer has_free_buffer = { t };
+    wait_for(&buffer_done, has_free_buffer);
+    base = t->free_buffers[t->free_head++ % num_buffers];
+    PIN_ReleaseLock(&queue_lock);
+    t->batch_start = t->cursor = base;
+    t->buffer_end = base + buffer_size;
+}
+
+static VOID worker(VOID *arg) {
+    HasFullBufferOrExit has_work;
+    for (;;) {
+        wait_for(&work_ready, has_work);
+        if (full_buffers.empty()) {
+            PIN_ReleaseLock(&queue_lock);
+            break;
+        }
+        Batch batch = full_buffers.front();
+        full_buffers.pop_front();
+        PIN_ReleaseLock(&queue_lock);
+
+        if (batch.count)
+            consumer(batch.owner->tid, batch.records, batch.count);
+
+        PIN_GetLock(&queue_lock, 0);
+        ThreadBuffers *t = batch.owner;
+        if (batch.done_buffer)
+            t->free_buffers[t->free_tail++ % num_buffers] = batch.done_buffer;
+        --t->in_flight;
+        PIN_SemaphoreSet(&buffer_done);
+        PIN_ReleaseLock(&queue_lock);
+    }
+    PIN_ExitThread(0);
+}
+
+/* ===================================================================== */
+// Analysis functions
+/* ===================================================================== */
+
+// Record an access, handing the buffer over for processing once it fills up
+VOID PIN_FAST_ANALYSIS_CALL append_access(THREADID tid, ADDRINT addr,
+                                          UINT32 size, UINT32 type)
+{
+    ThreadBuffers *t = thread_state(tid);
+    TraceRecord *record = t->cursor++;
+    record->addr = addr;
+    record->size = size;
+    record->type = type;
+    if (t->cursor == t->buffer_end)
+        submit(t, true);
+}
+
+// Record an allocation event made at instruction count 'time', and submit it
+// along with everything the thread recorded before it (see 'full_buffers').
+// The event and its clock record always go in the same buffer.
+VOID append_event(THREADID tid, UINT32 type, ADDRINT addr, INT32 size,
+                  UINT32 context, UINT64 time)
+{
+    ThreadBuffers *t = thread_state(tid);
+    if (t->buffer_end - t->cursor < 2)
+        submit(t, true);
+    TraceRecord *clock = t->cursor++;
+    clock->addr = time;
+    clock->size = 0;
+    clock->context = 0;
+    clock->type = TRACE_CLOCK;
+    TraceRecord *record = t->cursor++;
+    record->addr = addr;
+    record->size = size;
+    record->context = context;
+    record->type = type;
+    submit(t, t->cursor == t->buffer_end);
+}
+
+// Record that the thread has reached instruction count 'time'
+VOID append_clock(THREADID tid, UINT64 time) {
+    ThreadBuffers *t = thread_state(tid);
+    TraceRecord *clock = t->cursor++;
+    clock->addr = time;
+    clock->size = 0;
+    clock->context = 0;
+    clock->type = TRACE_CLOCK;
+    if (t->cursor == t->buffer_end)
+        submit(t, true);
+}
+
+// Process everything recorded so far by thread 'tid', blocking until the
+// analysis thread has caught up with it
+VOID drain(THREADID tid) {
+    if (!enabled)
+        return;
+    ThreadBuffers *t = thread_state(tid);
+    submit(t, false);
+    IsDrained is_drained = { t };
+    wait_for(&buffer_done, is_drained);
+    PIN_ReleaseLock(&queue_lock);
+}
+
+/* ===================================================================== */
+// Instrumentation functions
+/* ===================================================================== */
+
+// Each thread fills its own buffers, so that recording an access needs no
+// synchronisation
+static VOID thread_start(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
+    ThreadBuffers *t = new ThreadBuffers();
+    t->tid = tid;
+    t->free_buffers = (TraceRecord **)calloc(num_buffers,
+                                             sizeof(TraceRecord *));
+    for (UINT64 i = 0; t->free_buffers && i < num_buffers; ++i) {
+        TraceRecord *base = (TraceRecord *)malloc(buffer_size *
+                                                  sizeof(TraceRecord));
+        if (!base)
+            break;
+        if (i == 0) {
+            t->batch_start = t->cursor = base;
+            t->buffer_end = base + buffer_size;
+        } else {
+            t->free_buffers[t->free_tail++] = base;
+        }
+    }
+    if (t->free_tail != num_buffers - 1) {
+        cerr << "ERROR: Failed to allocate trace buffers\n";
+        PIN_ExitApplication(1);
+    }
+    PIN_SetThreadData(tls_key, t, tid);
+}
+
+// Process the rest of the thread's trace before anything else tears down its
+// state
+static VOID thread_fini(THREADID tid, const CONTEXT *ctxt, INT32 code,
+                        VOID *v)
+{
+    ThreadBuffers *t = thread_state(tid);
+    drain(tid);
+    free(t->buffer_end - buffer_size);
+    while (t->free_head != t->free_tail)
+        free(t->free_buffers[t->free_head++ % num_buffers]);
+    free(t->free_buffers);
+    delete t;
+    PIN_SetThreadData(tls_key, NULL, tid);
+}
+
+static VOID prepare_for_fini(VOID *v) {
+    PIN_GetLock(&queue_lock, 0);
+    exiting = true;
+    PIN_SemaphoreSet(&work_ready);
+    PIN_ReleaseLock(&queue_lock);
+    PIN_WaitForThreadTermination(worker_uid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+// NOTE: The consumer's own thread fini function (e.g. the one retiring
+// DynAccessTracer's per-thread affinity state) must be registered after this
+// is called, so that each thread's remaining events are flushed while the
+// state they're processed into still exists. If 'required', heap events are
+// buffered even if no buffer size was given.
+static void initialize(TraceConsumer fn, bool required) {
+    buffer_size = KnobTraceBufferSize.Value();
+    num_buffers = KnobTraceBuffers.Value();
+    if (!buffer_size && required)
+        buffer_size = TRACE_BUFFER_DEFAULT_SIZE;
+    if (!buffer_size)
+        return;
+    if (num_buffers < 2 || buffer_size < 2) {
+        cerr << "ERROR: at least two trace buffers of at least two records "
+                "are required\n";
+        PIN_ExitApplication(1);
+    }
+
+    consumer = fn;
+    tls_key = PIN_CreateThreadDataKey(NULL);
+    PIN_InitLock(&queue_lock);
+    PIN_SemaphoreInit(&work_ready);
+    PIN_SemaphoreInit(&buffer_done);
+    if (PIN_SpawnInternalThread(worker, NULL, 0, &worker_uid) ==
+        INVALID_THREADID)
+    {
+        cerr << "ERROR: Failed to start trace analysis thread\n";
+        PIN_ExitApplication(1);
+    }
+    Attach::add_thread_functions(thread_start, thread_fini);
+    Attach::add_prepare_for_fini_function(prepare_for_fini);
+    enabled = true;
+}
+}
@@ -0,0 +1,274 @@
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+// Trace versions. Heap accesses are only instrumented in traced versions, and
+// threads switch between versions at trace boundaries.
+#define TRACE_VERSION_TRACED  0
+#define TRACE_VERSION_SKIPPED 1
+
+#define NO_WINDOW_END (~0ULL)
+
+// Decides which parts of the run have their heap accesses traced: a thread
+// traces accesses while it is inside one of its instruction windows, between
+// the region of interest markers (if any), and within a sampling burst (if
+// sampling). Allocations are always traced, so objects allocated outside of
+// these regions are still attributed correctly.
+namespace TraceControl {
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+
+KNOB<UINT64> KnobSamplePeriod(KNOB_MODE_WRITEONCE, "pintool",
+    "sample-period", "0", "trace heap accesses in bursts, once every this "
+    "many instructions per thread (0 traces continuously)");
+KNOB<UINT64> KnobSampleLength(KNOB_MODE_WRITEONCE, "pintool",
+    "sample-length", "0", "number of instructions traced at the start of "
+    "each sample period");
+KNOB<UINT64> KnobSkipInstructions(KNOB_MODE_WRITEONCE, "pintool",
+    "skip-instructions", "0", "don't trace heap accesses made during each "
+    "thread's first this many instructions");
+KNOB<string> KnobTraceWindows(KNOB_MODE_WRITEONCE, "pintool",
+    "trace-windows", "", "comma-separated list of start-end instruction "
+    "windows of each thread to trace heap accesses in (the end may be "
+    "omitted)");
+KNOB<string> KnobRoiBegin(KNOB_MODE_WRITEONCE, "pintool", "roi-begin", "",
+    "don't trace heap accesses until this function is called");
+KNOB<string> KnobRoiEnd(KNOB_MODE_WRITEONCE, "pintool", "roi-end", "",
+    "stop tracing heap accesses when this function is called, until the "
+    "region of interest begins again");
+
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+struct ThreadControl {
+    ADDRINT version;
+    INT64 countdown;
+    bool in_burst;
+    bool in_window;
+    UINT32 next_boundary;
+    UINT64 instrs;
+    UINT64 traced_instrs;
+    UINT64 total_instrs;
+};
+
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static bool controlled = false;
+static bool bursty = false;
+static UINT64 sample_period = 0;
+static UINT64 sample_length = 0;
+static REG version_reg;
+static TLS_KEY tls_key;
+
+// The instruction counts at which each thread enters and leaves its windows,
+// alternately
+static vector<UINT64> boundaries;
+
+// Shared by all threads, which notice changes at their next basic block
+static volatile bool in_roi = true;
+
+// Totals from exited threads. Only instructions executed within windows and
+// the region of interest count towards 'total_instrs', so that sampled counts
+// are scaled up to the profiled part of the run rather than all of it.
+static UINT64 traced_instrs = 0;
+static UINT64 total_instrs = 0;
+static PIN_LOCK totals_lock;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static inline ThreadControl *thread_state(THREADID tid) {
+    return static_cast<ThreadControl *>(PIN_GetThreadData(tls_key, tid));
+}
+
+// Parse the trace windows, clipping them to start after the skipped
+// instructions
+static VOID parse_windows(const string &list, UINT64 skip) {
+    const char *str = list.empty() ? "0-" : list.c_str();
+    UINT64 last_end = 0;
+    while (*str) {
+        char *end;
+        UINT64 start = strtoull(str, &end, 0);
+        UINT64 stop = NO_WINDOW_END;
+        bool valid = end != str && *end == '-';
+        if (valid && end[1] && end[1] != ',') {
+            str = end + 1;
+            stop = strtoull(str, &end, 0);
+            valid = end != str && stop > start;
+        } else if (valid) {
+            ++end;
+        }
+        if (!valid || (*end && *end != ',') || start < last_end) {
+            cerr << "ERROR: trace windows must be given in order as "
+                    "'start-end' or 'start-'\n";
+            PIN_ExitApplication(1);
+        }
+        last_end = stop;
+        start = std::max(start, skip);
+        if (start < stop) {
+            boundaries.push_back(start);
+            boundaries.push_back(stop);
+        }
+        str = *end ? end + 1 : end;
+    }
+}
+
+// Pass any window boundaries the thread has reached, and pick the trace
+// version it should be running
+static VOID update(ThreadControl *t) {
+    while (t->next_boundary < boundaries.size() &&
+           t->instrs >= boundaries[t->next_boundary])
+    {
+        t->in_window = !(t->next_boundary++ & 1);
+    }
+    t->version = t->in_burst && t->in_window && in_roi ?
+        TRACE_VERSION_TRACED : TRACE_VERSION_SKIPPED;
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+// Whether heap accesses should be instrumented in 'trace'
+static inline bool is_traced(TRACE trace) {
+    return TRACE_Version(trace) == TRACE_VERSION_TRACED;
+}
+
+// Scale factor turning counts sampled in bursts into estimates of the full
+// counts
+static double node_scale(void) {
+    return traced_instrs ? (double)total_instrs / traced_instrs : 1.0;
+}
+
+/* ===================================================================== */
+// Analysis functions
+/* ===================================================================== */
+
+// Advance the thread's instruction count, returning the trace version it
+// should be running. The block is counted against that version, so that
+// without bursts every instruction in a window and the region of interest is
+// counted as traced, and node_scale is exactly 1.
+ADDRINT PIN_FAST_ANALYSIS_CALL tick(THREADID tid, UINT32 num_instrs) {
+    ThreadControl *t = thread_state(tid);
+    t->instrs += num_instrs;
+    if (__builtin_expect(bursty && (t->countdown -= num_instrs) <= 0, 0)) {
+        t->in_burst = !t->in_burst;
+        t->countdown += t->in_burst ? sample_length
+                                    : sample_period - sample_length;
+    }
+    update(t);
+    if (t->in_window && in_roi) {
+        t->total_instrs += num_instrs;
+        if (t->version == TRACE_VERSION_TRACED)
+            t->traced_instrs += num_instrs;
+    }
+    return t->version;
+}
+
+VOID roi_begin(void) {
+    in_roi = true;
+}
+
+VOID roi_end(void) {
+    in_roi = false;
+}
+
+/* ===================================================================== */
+// Instrumentation functions
+/* ===================================================================== */
+
+static VOID instrument_trace(TRACE trace, VOID *v) {
+    // Switch to whichever version the thread's state asks for
+    INS head = BBL_InsHead(TRACE_BblHead(trace));
+    if (TRACE_Version(trace) != TRACE_VERSION_TRACED) {
+        INS_InsertVersionCase(head, version_reg, TRACE_VERSION_TRACED,
+                              TRACE_VERSION_TRACED, IARG_END);
+    }
+    if (TRACE_Version(trace) != TRACE_VERSION_SKIPPED) {
+        INS_InsertVersionCase(head, version_reg, TRACE_VERSION_SKIPPED,
+                              TRACE_VERSION_SKIPPED, IARG_END);
+    }
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)tick,
+                       IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_UINT32,
+                       BBL_NumIns(bbl), IARG_RETURN_REGS, version_reg,
+                       IARG_END);
+    }
+}
+
+static VOID instrument_marker(IMG img, const string &name, AFUNPTR marker) {
+    if (name.empty())
+        return;
+    RTN rtn = RTN_FindByName(img, name.c_str());
+    if (!RTN_Valid(rtn))
+        return;
+    RTN_Open(rtn);
+    RTN_InsertCall(rtn, IPOINT_BEFORE, marker, IARG_END);
+    RTN_Close(rtn);
+}
+
+static VOID instrument_image(IMG img, VOID *v) {
+    instrument_marker(img, KnobRoiBegin.Value(), (AFUNPTR)roi_begin);
+    instrument_marker(img, KnobRoiEnd.Value(), (AFUNPTR)roi_end);
+}
+
+static VOID thread_start(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
+    ThreadControl *t = new ThreadControl();
+    t->in_burst = true;
+    t->countdown = sample_length;
+    update(t);
+    PIN_SetContextReg(ctxt, version_reg, t->version);
+    PIN_SetThreadData(tls_key, t, tid);
+}
+
+static VOID thread_fini(THREADID tid, const CONTEXT *ctxt, INT32 code,
+                        VOID *v)
+{
+    ThreadControl *t = thread_state(tid);
+    PIN_GetLock(&totals_lock, tid + 1);
+    traced_instrs += t->traced_instrs;
+    total_instrs += t->total_instrs;
+    PIN_ReleaseLock(&totals_lock);
+    delete t;
+    PIN_SetThreadData(tls_key, NULL, tid);
+}
+
+static void initialize(void) {
+    sample_period = KnobSamplePeriod.Value();
+    sample_length = KnobSampleLength.Value();
+    if (sample_period && (!sample_length || sample_length > sample_period)) {
+        cerr << "ERROR: sample length must be between 1 and the sample "
+                "period\n";
+        PIN_ExitApplication(1);
+    }
+    parse_windows(KnobTraceWindows.Value(), KnobSkipInstructions.Value());
+    if (!KnobRoiBegin.Value().empty())
+        in_roi = false;
+
+    // Sampling every instruction is the same as not sampling at all, and
+    // a single window from the start is the same as having none
+    bursty = sample_period && sample_length < sample_period;
+    controlled = bursty || !in_roi || !KnobRoiEnd.Value().empty() ||
+                 boundaries.size() != 2 || boundaries[0] != 0 ||
+                 boundaries[1] != NO_WINDOW_END;
+    if (!controlled)
+        return;
+
+    version_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(version_reg)) {
+        cerr << "ERROR: No tool register available for trace control\n";
+        PIN_ExitApplication(1);
+    }
+    tls_key = PIN_CreateThreadDataKey(NULL);
+    PIN_InitLock(&totals_lock);
+    TRACE_AddInstrumentFunction(instrument_trace, 0);
+    IMG_AddInstrumentFunction(instrument_image, 0);
+    Attach::add_thread_functions(thread_start, thread_fini);
+}
+}
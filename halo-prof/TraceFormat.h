@@ -0,0 +1,173 @@
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+// Heap events recorded for deferred processing. Allocation events travel in
+// the same stream as accesses so that the consumer sees them in program order,
+// each preceded by a clock record holding the thread's instruction count (in
+// 'addr') at the time. Skipped accesses are made by code that isn't profiled
+// (see AccessFilter.h), and only age the affinity window.
+enum TraceRecordType {
+    TRACE_READ = 'R',
+    TRACE_WRITE = 'W',
+    TRACE_ALLOC = 'A',
+    TRACE_REALLOC = 'M',
+    TRACE_FREE = 'F',
+    TRACE_CLOCK = 'T',
+    TRACE_SKIP = 'S'
+};
+struct TraceRecord {
+    ADDRINT addr;
+    INT32 size;
+    UINT32 context;
+    UINT32 type;
+};
+typedef VOID (*TraceConsumer)(THREADID tid, const TraceRecord *records,
+                              UINT64 count);
+
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+// A heap trace file is a header (the magic string, format version and the
+// maximum object size it was recorded with) followed by a sequence of chunks,
+// each starting with its kind:
+//
+//   TRACE_CHUNK_RECORDS:    thread id, record count, byte count, records
+//   TRACE_CHUNK_THREAD_END: thread id
+//   TRACE_CHUNK_SUMMARY:    instruction counts, context count, contexts text
+//   TRACE_CHUNK_END:        (nothing)
+//
+// All integers are LEB128 varints. Record chunks hold one batch of a single
+// thread's records and are encoded independently of each other, so they can
+// be decoded in any order (and in parallel).
+#define TRACE_FILE_MAGIC       "HALOTRC"
+#define TRACE_FILE_MAGIC_SIZE  8
+#define TRACE_FILE_VERSION     2
+#define TRACE_CHUNK_END        0
+#define TRACE_CHUNK_RECORDS    1
+#define TRACE_CHUNK_THREAD_END 2
+#define TRACE_CHUNK_SUMMARY    3
+
+// Each record starts with a tag byte holding its type code (the index into
+// TRACE_TYPE_CODES) and a size code: 0 means an explicit size follows, and
+// k > 0 means a size of 2^(k - 1) bytes. The address follows as the
+// (zigzag-encoded) difference from the previous record's address, and
+// allocations end with their context id. Clock records are just the tag and
+// the instruction count.
+#define TRACE_TYPE_CODES "RWAMFTS"
+#define TRACE_TYPE_BITS  3
+
+namespace TraceFormat {
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static inline VOID put_varint(vector<UINT8> &out, UINT64 value) {
+    while (value >= 0x80) {
+        out.push_back((UINT8)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((UINT8)value);
+}
+
+static inline bool get_varint(const UINT8 *&p, const UINT8 *end,
+                              UINT64 *value)
+{
+    UINT64 result = 0;
+    for (UINT32 shift = 0; p != end && shift < 64; shift += 7) {
+        UINT8 byte = *p++;
+        result |= (UINT64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline UINT64 zigzag(INT64 value) {
+    return ((UINT64)value << 1) ^ (UINT64)(value >> 63);
+}
+
+static inline INT64 unzigzag(UINT64 value) {
+    return (INT64)(value >> 1) ^ -(INT64)(value & 1);
+}
+
+static inline UINT32 size_code(INT32 size) {
+    if (size <= 0 || (size & (size - 1)))
+        return 0;
+    return __builtin_ctz(size) + 1;
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+// Append the encoding of 'count' records to 'out'
+static inline VOID encode_records(vector<UINT8> &out,
+                                  const TraceRecord *records, UINT64 count)
+{
+    ADDRINT prev = 0;
+    for (const TraceRecord *r = records; r != records + count; ++r) {
+        UINT32 type = strchr(TRACE_TYPE_CODES, r->type) - TRACE_TYPE_CODES;
+        if (r->type == TRACE_CLOCK) {
+            out.push_back((UINT8)type);
+            put_varint(out, r->addr);
+            continue;
+        }
+        UINT32 code = size_code(r->size);
+        out.push_back((UINT8)(type | (code << TRACE_TYPE_BITS)));
+        if (!code)
+            put_varint(out, zigzag(r->size));
+        put_varint(out, zigzag((INT64)(r->addr - prev)));
+        if (r->type == TRACE_ALLOC || r->type == TRACE_REALLOC)
+            put_varint(out, r->context);
+        prev = r->addr;
+    }
+}
+
+// Decode 'count' records from [p, end), returning false if the encoding is
+// malformed
+static inline bool decode_records(const UINT8 *p, const UINT8 *end,
+                                  TraceRecord *records, UINT64 count)
+{
+    ADDRINT prev = 0;
+    for (TraceRecord *r = records; r != records + count; ++r) {
+        UINT64 value;
+        if (p == end)
+            return false;
+        UINT8 tag = *p++;
+        UINT32 type = tag & ((1 << TRACE_TYPE_BITS) - 1);
+        UINT32 code = tag >> TRACE_TYPE_BITS;
+        if (type >= sizeof(TRACE_TYPE_CODES) - 1)
+            return false;
+        r->type = TRACE_TYPE_CODES[type];
+        r->context = 0;
+        if (r->type == TRACE_CLOCK) {
+            if (!get_varint(p, end, &value))
+                return false;
+            r->addr = value;
+            r->size = 0;
+            continue;
+        }
+        if (code) {
+            r->size = 1 << (code - 1);
+        } else {
+            if (!get_varint(p, end, &value))
+                return false;
+            r->size = (INT32)unzigzag(value);
+        }
+        if (!get_varint(p, end, &value))
+            return false;
+        r->addr = prev + (ADDRINT)unzigzag(value);
+        if (r->type == TRACE_ALLOC || r->type == TRACE_REALLOC) {
+            if (!get_varint(p, end, &value))
+                return false;
+            r->context = (UINT32)value;
+        }
+        prev = r->addr;
+    }
+    return p == end;
+}
+}
@@ -0,0 +1,105 @@
+// Records the buffered heap events of every thread to a file (in the format
+// described in TraceFormat.h) for halo-analyze to replay, instead of profiling
+// affinity as the program runs
+namespace TraceWriter {
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+
+KNOB<string> KnobTraceOutput(KNOB_MODE_WRITEONCE, "pintool",
+    "trace-output", "", "record heap events to this file for halo-analyze "
+    "instead of building a locality graph");
+
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static bool enabled = false;
+static ofstream trace;
+static UINT64 bytes_written = 0;
+
+// Batches may be written by the analysis thread or (once it has stopped) by
+// application threads, so the output is guarded by 'write_lock'
+static vector<UINT8> chunk;
+static vector<UINT8> payload;
+static PIN_LOCK write_lock;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static VOID flush_chunk(void) {
+    trace.write((const char *)&chunk[0], chunk.size());
+    bytes_written += chunk.size();
+    chunk.clear();
+}
+
+/* ===================================================================== */
+// Interface
+/* ===================================================================== */
+
+// Record a batch of heap events buffered by thread 'tid' (a TraceConsumer)
+static VOID write_records(THREADID tid, const TraceRecord *records,
+                          UINT64 count)
+{
+    if (!ShadowStack::entered_main)
+        return;
+    PIN_GetLock(&write_lock, tid + 1);
+    payload.clear();
+    TraceFormat::encode_records(payload, records, count);
+    TraceFormat::put_varint(chunk, TRACE_CHUNK_RECORDS);
+    TraceFormat::put_varint(chunk, tid);
+    TraceFormat::put_varint(chunk, count);
+    TraceFormat::put_varint(chunk, payload.size());
+    chunk.insert(chunk.end(), payload.begin(), payload.end());
+    flush_chunk();
+    PIN_ReleaseLock(&write_lock);
+}
+
+// Record that thread 'tid' has finished (after the rest of its trace)
+static VOID thread_end(THREADID tid) {
+    PIN_GetLock(&write_lock, tid + 1);
+    TraceFormat::put_varint(chunk, TRACE_CHUNK_THREAD_END);
+    TraceFormat::put_varint(chunk, tid);
+    flush_chunk();
+    PIN_ReleaseLock(&write_lock);
+}
+
+// Finish the trace with everything needed to write the contexts file and
+// scale sampled counts, once every thread has finished
+static VOID finalize(INT32 code, VOID *v) {
+    ostringstream contexts;
+    DynAllocTracer::write_contexts(contexts);
+    string text = contexts.str();
+    TraceFormat::put_varint(chunk, TRACE_CHUNK_SUMMARY);
+    TraceFormat::put_varint(chunk, DynAllocTracer::instr_count);
+    TraceFormat::put_varint(chunk, TraceControl::traced_instrs);
+    TraceFormat::put_varint(chunk, TraceControl::total_instrs);
+    TraceFormat::put_varint(chunk, DynAllocTracer::next_context_id);
+    TraceFormat::put_varint(chunk, text.size());
+    chunk.insert(chunk.end(), text.begin(), text.end());
+    TraceFormat::put_varint(chunk, TRACE_CHUNK_END);
+    flush_chunk();
+    trace.close();
+    cerr << "Recorded " << bytes_written << " bytes of heap trace" << endl;
+}
+
+static void initialize(void) {
+    if (KnobTraceOutput.Value().empty())
+        return;
+    trace.open(KnobTraceOutput.Value().c_str(), ios::out | ios::binary);
+    if (!trace) {
+        cerr << "ERROR: Failed to open heap trace output\n";
+        PIN_ExitApplication(1);
+    }
+    trace.write(TRACE_FILE_MAGIC, TRACE_FILE_MAGIC_SIZE);
+    TraceFormat::put_varint(chunk, TRACE_FILE_VERSION);
+    TraceFormat::put_varint(chunk, TraceFormat::zigzag(
+        DynAllocTracer::max_object_size));
+    flush_chunk();
+    bytes_written += TRACE_FILE_MAGIC_SIZE;
+    PIN_InitLock(&write_lock);
+    Attach::add_fini_function(finalize);
+    enabled = true;
+}
+}
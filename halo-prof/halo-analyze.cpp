@@ -0,0 +1,424 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <thread>
+
+using namespace std;
+
+/* ===================================================================== */
+// Pin compatibility
+/* ===================================================================== */
+
+// The profiler headers shared with halo-prof only need Pin's basic types
+typedef void VOID;
+typedef bool BOOL;
+typedef char CHAR;
+typedef uint8_t UINT8;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef uintptr_t ADDRINT;
+typedef UINT32 THREADID;
+
+static VOID PIN_ExitApplication(INT32 code) {
+    exit(code);
+}
+
+/* ===================================================================== */
+// Includes
+/* ===================================================================== */
+
+#include "ShadowMemory.h"
+#include "TraceFormat.h"
+#include "ObjectTable.h"
+#include "ContextReport.h"
+#include "CacheSim.h"
+#include "EdgeTable.h"
+#include "FieldProfile.h"
+#include "AffinityWindow.h"
+#include "PageGraph.h"
+#include "AffinityGraph.h"
+
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+
+// Options take the same names (and defaults) as halo-prof's
+struct Option {
+    const char *name;
+    string value;
+    const char *description;
+};
+
+static Option options[] = {
+    { "affinity-distance", "1024", "maximum affinity distance in bytes" },
+    { "affinity-distances", "", "comma-separated list of smaller affinity "
+      "distances to also write locality graphs for" },
+    { "affinity-model", "bytes", "what the affinity distance measures: "
+      "'bytes', 'all-accesses', 'lines' or 'decay' (all-accesses and decay "
+      "are only as complete as the trace, see halo-prof)" },
+    { "affinity-half-life", "1000", "number of instructions over which edge "
+      "weights halve in the decay model" },
+    { "max-edges", "0", "keep at most this many affinity edges per graph, "
+      "folding the lightest into a count-min sketch (0 keeps every edge)" },
+    { "cross-thread-affinity", "0", "count affinity between accesses made by "
+      "different threads" },
+    { "sample-objects", "1", "only count affinity between objects in a "
+      "sampled subset of one in this many" },
+    { "max-object-size", "", "maximum size of co-allocatable objects "
+      "(defaults to, and may not exceed, the size the trace was recorded "
+      "with)" },
+    { "interval-length", "0", "also write the heap accesses and affinity "
+      "edges of each interval of this many instructions per thread (0 writes "
+      "none)" },
+    { "interval-output", "intervals.txt", "specify interval output filename" },
+    { "tgf-output", "locality.tgf", "specify TGF output filename" },
+    { "contexts-output", "contexts.txt", "specify contexts output filename" },
+    { "sort-edges", "1", "write TGF edges in context id order" },
+    { "report-output", "", "write a JSON report of each allocation context's "
+      "heap statistics to this file" },
+    { "field-output", "", "write a JSON profile of the fields each allocation "
+      "context's objects are accessed at, and the cache lines co-accessed "
+      "along each edge, to this file" },
+    { "field-size", "8", "granularity in bytes of the field access "
+      "histograms" },
+    { "page-output", "", "also write a TGF graph of the contexts accessed "
+      "within a window of distinct pages of each other (for TLB reach) to "
+      "this file" },
+    { "page-size", "4096", "page size in bytes of the page graph (e.g. "
+      "2097152 for huge pages)" },
+    { "page-window", "64", "number of distinct pages in the page graph's "
+      "affinity window" },
+    { "cache-output", "", "simulate the cache behaviour of heap accesses and "
+      "write the misses of each allocation context to this file" },
+    { "cache-geometry", "32768:8,1048576:16,64:4", "simulated L1 and L2 sizes "
+      "and TLB entries, each with its associativity" },
+    { "cache-groups", "", "also simulate heap accesses with objects grouped as "
+      "in this groups file, to predict the misses grouping would save" },
+    { "cache-chunk-size", "1048576", "libhalo chunk size to simulate grouping "
+      "with" },
+    { "cache-spare-chunks", "1", "maximum number of empty libhalo chunks kept "
+      "for reuse (0 for no limit)" },
+    { "threads", "0", "number of threads decoding the trace (0 uses one per "
+      "core)" },
+};
+
+/* ================================================================== */
+// Structures and types
+/* ================================================================== */
+
+// A chunk of the trace, read in file order and decoded in parallel
+struct Chunk {
+    UINT64 kind;
+    UINT64 tid;
+    UINT64 count;
+    vector<UINT8> payload;
+    vector<TraceRecord> records;
+    bool valid;
+};
+
+// The instruction counts and contexts recorded at the end of the trace
+struct Summary {
+    UINT64 instr_count;
+    UINT64 traced_instrs;
+    UINT64 total_instrs;
+    UINT64 num_contexts;
+    string contexts;
+};
+
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+#define CHUNKS_PER_THREAD 4
+
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+// Per-thread affinity states, by the thread id they were recorded with
+static map<UINT64, AffinityState *> threads;
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static const string &option(const char *name) {
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); ++i)
+        if (!strcmp(options[i].name, name))
+            return options[i].value;
+    abort();
+}
+
+static UINT64 option_int(const char *name) {
+    return strtoull(option(name).c_str(), NULL, 0);
+}
+
+static VOID usage(const char *argv0) {
+    cerr << "Usage: " << argv0 << " [options] <trace>\n\n"
+         << "Replays a heap trace recorded by halo-prof (-trace-output) to "
+            "write its locality\ngraph and contexts file.\n\n";
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); ++i) {
+        cerr << "  -" << options[i].name << " [" << options[i].value << "]\n"
+             << "      " << options[i].description << "\n";
+    }
+    exit(1);
+}
+
+// Parse options given as '-name value', accepting '_' in place of '-' as Pin
+// does
+static const char *parse_options(int argc, char *argv[]) {
+    const char *trace = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] != '-') {
+            if (trace)
+                usage(argv[0]);
+            trace = argv[i];
+            continue;
+        }
+        string name = argv[i] + 1 + (argv[i][1] == '-');
+        replace(name.begin(), name.end(), '_', '-');
+        size_t j = 0;
+        while (j < sizeof(options) / sizeof(options[0]) &&
+               name != options[j].name)
+        {
+            ++j;
+        }
+        if (j == sizeof(options) / sizeof(options[0]) || i + 1 == argc)
+            usage(argv[0]);
+        options[j].value = argv[++i];
+    }
+    if (!trace)
+        usage(argv[0]);
+    return trace;
+}
+
+static bool read_varint(istream &in, UINT64 *value) {
+    UINT64 result = 0;
+    for (UINT32 shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == EOF)
+            return false;
+        result |= (UINT64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static VOID truncated(void) {
+    cerr << "ERROR: Heap trace is truncated or corrupt\n";
+    exit(1);
+}
+
+// Read the next chunk. Record chunks are only decoded later.
+static VOID read_chunk(istream &in, Chunk *chunk, Summary *summary) {
+    UINT64 bytes;
+    if (!read_varint(in, &chunk->kind))
+        truncated();
+    switch (chunk->kind) {
+      case TRACE_CHUNK_RECORDS:
+        if (!read_varint(in, &chunk->tid) || !read_varint(in, &chunk->count) ||
+            !read_varint(in, &bytes))
+        {
+            truncated();
+        }
+        chunk->payload.resize(bytes);
+        if (bytes && !in.read((char *)&chunk->payload[0], bytes))
+            truncated();
+        break;
+      case TRACE_CHUNK_THREAD_END:
+        if (!read_varint(in, &chunk->tid))
+            truncated();
+        break;
+      case TRACE_CHUNK_SUMMARY:
+        if (!read_varint(in, &summary->instr_count) ||
+            !read_varint(in, &summary->traced_instrs) ||
+            !read_varint(in, &summary->total_instrs) ||
+            !read_varint(in, &summary->num_contexts) ||
+            !read_varint(in, &bytes))
+        {
+            truncated();
+        }
+        summary->contexts.resize(bytes);
+        if (bytes && !in.read(&summary->contexts[0], bytes))
+            truncated();
+        break;
+      case TRACE_CHUNK_END:
+        break;
+      default:
+        truncated();
+    }
+}
+
+// Decode every 'stride'th record chunk of 'chunks', starting at 'first'
+static VOID decode_chunks(vector<Chunk> *chunks, size_t count, size_t first,
+                          size_t stride)
+{
+    for (size_t i = first; i < count; i += stride) {
+        Chunk *chunk = &(*chunks)[i];
+        if (chunk->kind != TRACE_CHUNK_RECORDS)
+            continue;
+        chunk->records.resize(chunk->count);
+        chunk->valid = TraceFormat::decode_records(
+            chunk->payload.data(), chunk->payload.data() + chunk->payload.size(),
+            chunk->records.data(), chunk->count);
+    }
+}
+
+static AffinityState *thread_state(UINT64 tid) {
+    map<UINT64, AffinityState *>::iterator it = threads.find(tid);
+    if (it != threads.end())
+        return it->second;
+    AffinityState *state = DynAccessTracer::new_state();
+    threads[tid] = state;
+    return state;
+}
+
+// Replay a decoded chunk, in trace order
+static VOID apply_chunk(Chunk *chunk) {
+    if (chunk->kind == TRACE_CHUNK_RECORDS) {
+        if (!chunk->valid)
+            truncated();
+        DynAccessTracer::process_records(thread_state(chunk->tid),
+                                         chunk->records.data(), chunk->count);
+    } else if (chunk->kind == TRACE_CHUNK_THREAD_END) {
+        map<UINT64, AffinityState *>::iterator it = threads.find(chunk->tid);
+        if (it != threads.end()) {
+            DynAccessTracer::retire_state(it->second);
+            threads.erase(it);
+        }
+    }
+}
+
+/* ===================================================================== */
+// Entry point
+/* ===================================================================== */
+
+int main(int argc, char *argv[]) {
+    const char *filename = parse_options(argc, argv);
+    ifstream in(filename, ios::in | ios::binary);
+    if (!in) {
+        cerr << "ERROR: Failed to open heap trace " << filename << "\n";
+        return 1;
+    }
+
+    // Check the header
+    char magic[TRACE_FILE_MAGIC_SIZE];
+    UINT64 version, recorded_size;
+    if (!in.read(magic, TRACE_FILE_MAGIC_SIZE) ||
+        memcmp(magic, TRACE_FILE_MAGIC, TRACE_FILE_MAGIC_SIZE) ||
+        !read_varint(in, &version) || version != TRACE_FILE_VERSION ||
+        !read_varint(in, &recorded_size))
+    {
+        cerr << "ERROR: " << filename << " is not a heap trace this version "
+                "of halo-analyze can read\n";
+        return 1;
+    }
+    INT32 max_size = (INT32)TraceFormat::unzigzag(recorded_size);
+    if (!option("max-object-size").empty()) {
+        INT32 size = (INT32)option_int("max-object-size");
+        if (size > max_size) {
+            cerr << "ERROR: maximum object size must be no larger than the "
+                    "one the trace was recorded with (" << max_size << ")\n";
+            return 1;
+        }
+        max_size = size;
+    }
+
+    // Set up the same model as halo-prof
+    ShadowMemory::initialize();
+    DynAllocTracer::max_object_size = max_size;
+    ContextReport::enabled = !option("report-output").empty();
+    if (!option("field-output").empty())
+        FieldProfile::configure(option_int("field-size"));
+    if (!option("page-output").empty())
+        PageGraph::configure(option_int("page-size"),
+                             option_int("page-window"));
+    DynAccessTracer::configure(option_int("affinity-distance"),
+                               option("affinity-distances"),
+                               option_int("cross-thread-affinity"),
+                               option_int("sample-objects"),
+                               option_int("interval-length"),
+                               option("interval-output"),
+                               option("affinity-model"),
+                               option_int("affinity-half-life"),
+                               option_int("max-edges"));
+    if (!option("cache-output").empty()) {
+        CacheSim::configure(option("cache-geometry"), option("cache-groups"),
+                            option_int("cache-chunk-size"),
+                            option_int("cache-spare-chunks"));
+    }
+
+    // Decoding is independent for each chunk, so batches of chunks are
+    // decoded in parallel and then replayed in order
+    size_t num_threads = option_int("threads");
+    if (!num_threads)
+        num_threads = max(1U, thread::hardware_concurrency());
+    vector<Chunk> chunks(num_threads * CHUNKS_PER_THREAD);
+    Summary summary = {};
+    bool done = false;
+    while (!done) {
+        size_t count = 0;
+        while (count < chunks.size() && !done) {
+            read_chunk(in, &chunks[count], &summary);
+            done = chunks[count++].kind == TRACE_CHUNK_END;
+        }
+        vector<thread> decoders;
+        for (size_t i = 1; i < num_threads; ++i)
+            decoders.push_back(thread(decode_chunks, &chunks, count, i,
+                                      num_threads));
+        decode_chunks(&chunks, count, 0, num_threads);
+        for (size_t i = 0; i < decoders.size(); ++i)
+            decoders[i].join();
+        for (size_t i = 0; i < count; ++i)
+            apply_chunk(&chunks[i]);
+    }
+
+    // Threads still running at exit never recorded their end
+    while (!threads.empty()) {
+        DynAccessTracer::retire_state(threads.begin()->second);
+        threads.erase(threads.begin());
+    }
+
+    // Write the outputs
+    ofstream contexts(option("contexts-output").c_str());
+    contexts << summary.contexts;
+    contexts.close();
+    DynAllocTracer::next_context_id = summary.num_contexts;
+    double node_scale = summary.traced_instrs ?
+        (double)summary.total_instrs / summary.traced_instrs : 1.0;
+    cerr << "Replayed a run of " << summary.instr_count << " instructions."
+         << endl;
+    DynAccessTracer::write_locality_graphs(option("tgf-output"),
+                                           option_int("sort-edges"),
+                                           node_scale);
+    if (ContextReport::enabled) {
+        ContextReport::write(option("report-output"), summary.instr_count,
+                             node_scale);
+    }
+    if (CacheSim::enabled)
+        CacheSim::write(option("cache-output"));
+    if (FieldProfile::enabled) {
+        FieldProfile::write(option("field-output"), node_scale,
+                            DynAccessTracer::edge_scale(node_scale));
+    }
+    if (PageGraph::enabled) {
+        PageGraph::write(option("page-output"), node_scale,
+                         DynAccessTracer::sampled_edge_scale(node_scale));
+    }
+    return 0;
+}
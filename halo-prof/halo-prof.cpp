@@ -1,11 +1,15 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <unistd.h>
 #include <stdlib.h>
+#include <math.h>
 #include <algorithm>
 #include <limits.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
+#include <deque>
 #include <set>
 #include "pin.H"
 
@@ -19,81 +23,96 @@ KNOB<string> KnobLocalityGraphTGFOutput(KNOB_MODE_WRITEONCE, "pintool",
     "tgf-output", "locality.tgf", "specify TGF output filename");
 KNOB<INT32> KnobMaxSize(KNOB_MODE_WRITEONCE, "pintool", "max-object-size",
     "4096", "maximum size of co-allocatable objects");
+KNOB<BOOL> KnobSortEdges(KNOB_MODE_WRITEONCE, "pintool", "sort-edges", "1",
+    "write TGF edges in context id order");
+KNOB<string> KnobReportOutput(KNOB_MODE_WRITEONCE, "pintool",
+    "report-output", "", "write a JSON report of each allocation context's "
+    "heap statistics to this file");
+KNOB<string> KnobFieldOutput(KNOB_MODE_WRITEONCE, "pintool", "field-output",
+    "", "write a JSON profile of the fields each allocation context's objects "
+    "are accessed at, and the cache lines co-accessed along each edge, to "
+    "this file");
+KNOB<UINT32> KnobFieldSize(KNOB_MODE_WRITEONCE, "pintool", "field-size", "8",
+    "granularity in bytes of the field access histograms");
+KNOB<string> KnobPageOutput(KNOB_MODE_WRITEONCE, "pintool", "page-output",
+    "", "also write a TGF graph of the contexts accessed within a window of "
+    "distinct pages of each other (for TLB reach) to this file");
+KNOB<UINT64> KnobPageSize(KNOB_MODE_WRITEONCE, "pintool", "page-size",
+    "4096", "page size in bytes of the page graph (e.g. 2097152 for huge "
+    "pages)");
+KNOB<UINT32> KnobPageWindow(KNOB_MODE_WRITEONCE, "pintool", "page-window",
+    "64", "number of distinct pages in the page graph's affinity window");
+KNOB<string> KnobCacheOutput(KNOB_MODE_WRITEONCE, "pintool", "cache-output",
+    "", "simulate the cache behaviour of heap accesses and write the misses "
+    "of each allocation context to this file");
+KNOB<string> KnobCacheGeometry(KNOB_MODE_WRITEONCE, "pintool",
+    "cache-geometry", "32768:8,1048576:16,64:4", "simulated L1 and L2 sizes "
+    "and TLB entries, each with its associativity");
+KNOB<string> KnobCacheGroups(KNOB_MODE_WRITEONCE, "pintool", "cache-groups",
+    "", "also simulate heap accesses with objects grouped as in this groups "
+    "file, to predict the misses grouping would save");
+KNOB<UINT64> KnobCacheChunkSize(KNOB_MODE_WRITEONCE, "pintool",
+    "cache-chunk-size", "1048576", "libhalo chunk size to simulate grouping "
+    "with");
+KNOB<UINT64> KnobCacheSpareChunks(KNOB_MODE_WRITEONCE, "pintool",
+    "cache-spare-chunks", "1", "maximum number of empty libhalo chunks kept "
+    "for reuse (0 for no limit)");
 
 /* ===================================================================== */
 // Includes
 /* ===================================================================== */
 
+#include "Attach.h"
+#include "Allocators.h"
 #include "ShadowStack.h"
+#include "ShadowMemory.h"
+#include "TraceFormat.h"
+#include "ObjectTable.h"
+#include "ContextReport.h"
+#include "CacheSim.h"
+#include "EdgeTable.h"
+#include "FieldProfile.h"
+#include "AffinityWindow.h"
+#include "PageGraph.h"
+#include "AffinityGraph.h"
+#include "TraceControl.h"
+#include "AccessFilter.h"
+#include "TraceBuffer.h"
 #include "DynAllocTracer.h"
+#include "TraceWriter.h"
 #include "DynAccessTracer.h"
 
-/* ===================================================================== */
-// Helper functions
-/* ===================================================================== */
-
-static void write_tgf(vector<ChainPair> &contexts) {
-    ofstream LocalityGraph;
-    LocalityGraph.open(KnobLocalityGraphTGFOutput.Value().c_str());
-    LocalityGraph.setf(ios::showbase);
-
-    // Write nodes
-    for (vector<ChainPair>::iterator it = contexts.begin();
-         it != contexts.end(); ++it)
-    {
-        Context c = DynAllocTracer::contexts[it->second];
-        if (!c.mark)
-            continue;
-        LocalityGraph << it->second << " " << c.access_count << "\n";
-    }
-    LocalityGraph << "#\n";
-
-    // Write edges
-    for (size_t i = 0; i < contexts.size(); ++i) {
-        UINT32 i_mark = DynAllocTracer::contexts[i].mark;
-        for (size_t j = 0; i_mark && j <= i; ++j) {
-            UINT32 weight = DynAccessTracer::affinity_graph[i][j];
-            UINT32 j_mark = DynAllocTracer::contexts[j].mark;
-            if (j_mark && weight)
-                LocalityGraph << i << " " << j << " " << weight << "\n";
-        }
-    }
-    LocalityGraph.close();
-}
-
 /* ===================================================================== */
 // Analysis functions
 /* ===================================================================== */
 
-static VOID thread_end(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v) {
+// Runs once every thread's results have been merged
+static VOID finalize(INT32 code, VOID *v) {
     cerr << "Finished after executing " << DynAllocTracer::instr_count;
     cerr << " instructions." << endl;
-    if (code != 0)
+    if (code != 0 || TraceWriter::enabled)
         return;
 
-    // Sort allocation contexts by access frequency
-    vector<ChainPair> contexts = DynAllocTracer::chain_pairs();
-    sort(contexts.begin(), contexts.end(),
-         DynAllocTracer::sort_chain_pairs_by_accesses);
-
-    // Mark popular nodes
-    UINT32 accesses = 0;
-    UINT64 threshold = (UINT32)(((double)DynAccessTracer::access_count) * 0.9);
-    for (vector<ChainPair>::iterator it = contexts.begin();
-         it != contexts.end(); ++it)
-    {
-        Context *c = &DynAllocTracer::contexts[it->second];
-
-        // Stop marking nodes as popular once the access threshold is reached
-        c->mark = 1;
-        accesses += c->access_count;
-        if (accesses >= threshold)
-            break;
+    DynAccessTracer::write_locality_graphs(KnobLocalityGraphTGFOutput.Value(),
+                                           KnobSortEdges.Value(),
+                                           TraceControl::node_scale());
+    if (ContextReport::enabled) {
+        ContextReport::write(KnobReportOutput.Value(),
+                             DynAllocTracer::instr_count,
+                             TraceControl::node_scale());
+    }
+    if (CacheSim::enabled)
+        CacheSim::write(KnobCacheOutput.Value());
+    if (FieldProfile::enabled) {
+        double node_scale = TraceControl::node_scale();
+        FieldProfile::write(KnobFieldOutput.Value(), node_scale,
+                            DynAccessTracer::edge_scale(node_scale));
+    }
+    if (PageGraph::enabled) {
+        double node_scale = TraceControl::node_scale();
+        PageGraph::write(KnobPageOutput.Value(), node_scale,
+                         DynAccessTracer::sampled_edge_scale(node_scale));
     }
-
-    write_tgf(contexts);
-    cerr << "Generated locality graph accounting for " << accesses << " out of "
-         << DynAccessTracer::access_count << " unique object accesses" << endl;
 }
 
 /* ===================================================================== */
@@ -111,12 +130,28 @@ int main(int argc, char *argv[]) {
 
     // Initialize PIN tool
     cout << showbase;
+    Attach::initialize();
+    Allocators::initialize();
     ShadowStack::initialize();
+    ShadowMemory::initialize();
+    ContextReport::enabled = !KnobReportOutput.Value().empty();
+    if (!KnobFieldOutput.Value().empty())
+        FieldProfile::configure(KnobFieldSize.Value());
+    if (!KnobPageOutput.Value().empty())
+        PageGraph::configure(KnobPageSize.Value(), KnobPageWindow.Value());
+    TraceControl::initialize();
+    AccessFilter::initialize();
     DynAllocTracer::initialize();
+    if (!KnobCacheOutput.Value().empty()) {
+        CacheSim::configure(KnobCacheGeometry.Value(), KnobCacheGroups.Value(),
+                            KnobCacheChunkSize.Value(),
+                            KnobCacheSpareChunks.Value());
+    }
+    TraceWriter::initialize();
     DynAccessTracer::initialize();
 
     // Set up instrumentation functions and analysis callbacks
-    PIN_AddThreadFiniFunction(thread_end, NULL);
+    Attach::add_fini_function(finalize);
 
     // Start the program, never returns
     PIN_StartProgram();
@@ -1,5 +1,55 @@
 #!/bin/bash
 set -e
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+# Check the heap trace format, and that halo-analyze replays a known trace to
+# the expected locality graph (neither needs Pin)
+g++ -std=c++11 -O2 -pthread -o "$out/halo-analyze" ../halo-prof/halo-analyze.cpp
+g++ -std=c++11 -I../halo-prof -o "$out/trace-test" trace-test.cpp
+"$out/trace-test" "$out/trace-test.trace"
+"$out/halo-analyze" -tgf-output "$out/trace-test.tgf" \
+    -contexts-output "$out/trace-test-contexts.txt" "$out/trace-test.trace"
+cmp "$out/trace-test.tgf" trace-test.tgf
+cmp "$out/trace-test-contexts.txt" trace-test-contexts.txt
+
+# Bounded to fewer edges than it has, the graph must keep the heaviest ones
+# without underestimating them
+"$out/halo-analyze" -max-edges 2 -tgf-output "$out/trace-test-bounded.tgf" \
+    -contexts-output /dev/null "$out/trace-test.trace" 2> /dev/null
+cmp "$out/trace-test-bounded.tgf" trace-test-bounded.tgf
+
+# Merging a profile with itself must give back the same profile
+mkdir "$out/merged"
+../halo-prof/utils/halo-merge --graph trace-test.tgf \
+    --contexts trace-test-contexts.txt --graph trace-test.tgf \
+    --contexts trace-test-contexts.txt --outdir "$out/merged" > /dev/null
+cmp "$out/merged/graph.tgf" trace-test.tgf
+cmp "$out/merged/contexts.txt" trace-test-contexts.txt
+
+# Remapping a profile between builds with identical site keys must leave it
+# unchanged
+mkdir "$out/remapped"
+../halo-prof/utils/halo-remap --contexts trace-test-contexts.txt \
+    --graph trace-test.tgf --old-keys trace-test-keys.txt \
+    --new-keys trace-test-keys.txt --outdir "$out/remapped" > /dev/null
+cmp "$out/remapped/trace-test.tgf" trace-test.tgf
+cmp "$out/remapped/contexts.txt" trace-test-contexts.txt
+
 gcc test.c -g -O0 -no-pie -falign-functions=4096 -o test
+
+# Replaying a recorded heap trace must give the same locality graph as
+# profiling live
+tool="$HALO_PROF_PATH/obj-intel64/halo-prof.so"
+pin -t "$tool" -contexts-output "$out/live-contexts.txt" \
+    -tgf-output "$out/live.tgf" -- ./test > /dev/null
+pin -t "$tool" -contexts-output /dev/null -tgf-output /dev/null \
+    -trace-output "$out/test.trace" -- ./test > /dev/null
+"$HALO_PROF_PATH/obj-intel64/halo-analyze" \
+    -contexts-output "$out/replay-contexts.txt" \
+    -tgf-output "$out/replay.tgf" "$out/test.trace"
+cmp "$out/live.tgf" "$out/replay.tgf"
+cmp "$out/live-contexts.txt" "$out/replay-contexts.txt"
+
 halo baseline --jemalloc --trials 10 --pmu-events=L1-dcache-load-misses --directory ../results/test_tmp -- ./test
 halo run --jemalloc --trials 10 --pmu-events=L1-dcache-load-misses --affinity-distance 128 --directory ../results/test_tmp -- ./test -- ./test
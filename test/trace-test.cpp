@@ -0,0 +1,188 @@
+#include <iostream>
+#include <fstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* ===================================================================== */
+// Pin compatibility
+/* ===================================================================== */
+
+// TraceFormat.h only needs Pin's basic types, as in halo-analyze
+typedef void VOID;
+typedef uint8_t UINT8;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef uintptr_t ADDRINT;
+typedef UINT32 THREADID;
+
+#include "TraceFormat.h"
+
+/* ===================================================================== */
+// Constants
+/* ===================================================================== */
+
+// The synthetic program allocates this many objects, one from each context,
+// and makes this many passes over them
+#define NUM_OBJECTS 3
+#define NUM_PASSES  1000
+#define MAX_SIZE    4096
+
+/* ================================================================== */
+// Global variables
+/* ================================================================== */
+
+static int failures = 0;
+
+// Object 1 starts within the last 8-byte granule of object 2, which is
+// allocated after it, so that the two share a shadow memory cell
+static const ADDRINT object_addrs[NUM_OBJECTS] = { 0x10000, 0x1010c, 0x10100 };
+static const INT32 object_sizes[NUM_OBJECTS] = { 16, 16, 12 };
+
+/* ===================================================================== */
+// Helper functions
+/* ===================================================================== */
+
+static VOID check(bool condition, const char *what) {
+    if (!condition) {
+        cerr << "FAILED: " << what << "\n";
+        ++failures;
+    }
+}
+
+static TraceRecord record(UINT32 type, ADDRINT addr, INT32 size,
+                          UINT32 context)
+{
+    TraceRecord r = { addr, size, context, type };
+    return r;
+}
+
+// Append an allocation event behind its clock record, as halo-prof does
+static VOID event(vector<TraceRecord> &records, UINT32 type, ADDRINT addr,
+                  INT32 size, UINT32 context, UINT64 time)
+{
+    records.push_back(record(TRACE_CLOCK, time, 0, 0));
+    records.push_back(record(type, addr, size, context));
+}
+
+/* ===================================================================== */
+// Tests
+/* ===================================================================== */
+
+// Every record type, power-of-two and other sizes, and addresses moving both
+// ways must survive encoding, and malformed encodings must be rejected
+static VOID test_round_trip(void) {
+    vector<TraceRecord> records;
+    records.push_back(record(TRACE_CLOCK, 123456789012ULL, 0, 0));
+    records.push_back(record(TRACE_ALLOC, 0x7f0000001000ULL, 24, 70000));
+    records.push_back(record(TRACE_READ, 0x7f0000001008ULL, 8, 0));
+    records.push_back(record(TRACE_WRITE, 0x7f0000001000ULL, 1, 0));
+    records.push_back(record(TRACE_READ, 0x600000, 16, 0));
+    records.push_back(record(TRACE_SKIP, 0x7ffffffde000ULL, 32, 0));
+    records.push_back(record(TRACE_WRITE, 0x600010, 3, 0));
+    records.push_back(record(TRACE_REALLOC, 0x600000, 4096, 2));
+    records.push_back(record(TRACE_FREE, 0x7f0000001000ULL, 0, 0));
+
+    vector<UINT8> encoded;
+    TraceFormat::encode_records(encoded, &records[0], records.size());
+    vector<TraceRecord> decoded(records.size());
+    const UINT8 *begin = &encoded[0], *end = begin + encoded.size();
+    check(TraceFormat::decode_records(begin, end, &decoded[0],
+                                      decoded.size()),
+          "decoding encoded records");
+    for (size_t i = 0; i < records.size(); ++i) {
+        check(decoded[i].type == records[i].type &&
+              decoded[i].addr == records[i].addr &&
+              (decoded[i].type == TRACE_CLOCK ||
+               decoded[i].size == records[i].size) &&
+              decoded[i].context == ((records[i].type == TRACE_ALLOC ||
+                                      records[i].type == TRACE_REALLOC) ?
+                                     records[i].context : 0),
+              "decoded records match the encoded ones");
+    }
+    check(!TraceFormat::decode_records(begin, end - 1, &decoded[0],
+                                       decoded.size()),
+          "rejecting truncated records");
+    check(!TraceFormat::decode_records(begin, end, &decoded[0],
+                                       decoded.size() - 1),
+          "rejecting trailing bytes");
+}
+
+// Write a trace of a small program, in the format halo-prof records, for
+// test.sh to replay with halo-analyze. Objects 0 and 1 are accessed together
+// on every pass, and object 2 on every other one, both in the granule they
+// share. Object 1 is freed first and then accessed again, which must not be
+// counted.
+static VOID write_trace(const char *filename) {
+    vector<TraceRecord> records;
+    UINT64 time = 0;
+    for (UINT32 i = 0; i < NUM_OBJECTS; ++i) {
+        event(records, TRACE_ALLOC, object_addrs[i], object_sizes[i], i,
+              time++);
+    }
+    for (UINT32 pass = 0; pass < NUM_PASSES; ++pass) {
+        records.push_back(record(TRACE_READ, object_addrs[0], 8, 0));
+        records.push_back(record(TRACE_WRITE, object_addrs[1], 4, 0));
+        if (pass % 2 == 0)
+            records.push_back(record(TRACE_READ, object_addrs[2] + 8, 4, 0));
+        records.push_back(record(TRACE_READ, 0x900000, 8, 0));
+    }
+    event(records, TRACE_FREE, object_addrs[1], 0, 0, time++);
+    records.push_back(record(TRACE_READ, object_addrs[1] + 4, 8, 0));
+    event(records, TRACE_FREE, object_addrs[2], 0, 0, time++);
+    event(records, TRACE_FREE, object_addrs[0], 0, 0, time++);
+
+    string contexts;
+    for (UINT32 i = 0; i < NUM_OBJECTS; ++i) {
+        char chain[128];
+        snprintf(chain, sizeof(chain), "CTX %u:\n\toperator new(unsigned long) "
+                 "from 0x4011%u0\n\tmain from 0\n", i, i);
+        contexts += chain;
+    }
+
+    // Header, one chunk of records, then the thread's end and the summary
+    vector<UINT8> chunk, payload;
+    TraceFormat::put_varint(chunk, TRACE_FILE_VERSION);
+    TraceFormat::put_varint(chunk, TraceFormat::zigzag(MAX_SIZE));
+    TraceFormat::encode_records(payload, &records[0], records.size());
+    TraceFormat::put_varint(chunk, TRACE_CHUNK_RECORDS);
+    TraceFormat::put_varint(chunk, 0);
+    TraceFormat::put_varint(chunk, records.size());
+    TraceFormat::put_varint(chunk, payload.size());
+    chunk.insert(chunk.end(), payload.begin(), payload.end());
+    TraceFormat::put_varint(chunk, TRACE_CHUNK_THREAD_END);
+    TraceFormat::put_varint(chunk, 0);
+    TraceFormat::put_varint(chunk, TRACE_CHUNK_SUMMARY);
+    TraceFormat::put_varint(chunk, time);
+    TraceFormat::put_varint(chunk, time);
+    TraceFormat::put_varint(chunk, time);
+    TraceFormat::put_varint(chunk, NUM_OBJECTS);
+    TraceFormat::put_varint(chunk, contexts.size());
+    chunk.insert(chunk.end(), contexts.begin(), contexts.end());
+    TraceFormat::put_varint(chunk, TRACE_CHUNK_END);
+
+    ofstream out(filename, ios::out | ios::binary);
+    out.write(TRACE_FILE_MAGIC, TRACE_FILE_MAGIC_SIZE);
+    out.write((const char *)&chunk[0], chunk.size());
+    check(out.good(), "writing the trace");
+}
+
+/* ===================================================================== */
+// Entry point
+/* ===================================================================== */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        cerr << "Usage: " << argv[0] << " <trace>\n";
+        return 1;
+    }
+    test_round_trip();
+    write_trace(argv[1]);
+    return failures ? 1 : 0;
+}